@@ -0,0 +1,89 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+// pthread_mutex_lock, pthread_mutex_unlock
+#include <pthread.h>
+// free, posix_memalign
+#include <stdlib.h>
+
+#include "buffer.h"
+
+struct buffer_free {
+	struct buffer_free * next;
+};
+
+static struct buffer_free * buffer_free_list = NULL;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void buffer_exit(void) __attribute__((destructor));
+
+
+static void buffer_exit() {
+	while (buffer_free_list != NULL) {
+		struct buffer_free * buffer = buffer_free_list;
+		buffer_free_list = buffer->next;
+		free(buffer);
+	}
+}
+
+void * buffer_get() {
+	pthread_mutex_lock(&buffer_lock);
+
+	struct buffer_free * buffer = buffer_free_list;
+	if (buffer != NULL)
+		buffer_free_list = buffer->next;
+
+	pthread_mutex_unlock(&buffer_lock);
+
+	if (buffer != NULL)
+		return buffer;
+
+	void * new_buffer = NULL;
+	if (posix_memalign(&new_buffer, BUFFER_ALIGNMENT, BUFFER_SIZE) != 0)
+		return NULL;
+
+	return new_buffer;
+}
+
+void buffer_release(void * buffer) {
+	if (buffer == NULL)
+		return;
+
+	struct buffer_free * free_buffer = buffer;
+
+	pthread_mutex_lock(&buffer_lock);
+
+	free_buffer->next = buffer_free_list;
+	buffer_free_list = free_buffer;
+
+	pthread_mutex_unlock(&buffer_lock);
+}
+
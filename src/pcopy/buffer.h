@@ -0,0 +1,50 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#ifndef __PCOPY_BUFFER_H__
+#define __PCOPY_BUFFER_H__
+
+// size_t
+#include <sys/types.h>
+
+/**
+ * Buffers are aligned on BUFFER_ALIGNMENT so they can be used with O_DIRECT
+ */
+#define BUFFER_ALIGNMENT 4096
+#define BUFFER_SIZE 1048576
+
+#define buffer_align(size) (((size) + BUFFER_ALIGNMENT - 1) & ~((size_t) BUFFER_ALIGNMENT - 1))
+
+void * buffer_get(void) __attribute__((warn_unused_result));
+void buffer_release(void * buffer);
+
+#endif
+
@@ -33,9 +33,11 @@
 #include <fcntl.h>
 // gettext
 #include <libintl.h>
+// pthread_once
+#include <pthread.h>
 // dprintf, printf
 #include <stdio.h>
-// memmove, strcmp, strchr, strdup
+// memcpy, memmove, strcat, strchr, strdup, strlen, strncmp
 #include <string.h>
 // open
 #include <sys/stat.h>
@@ -48,18 +50,34 @@
 #include "checksum/digest.h"
 
 static int checksum_fd = -1;
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
 
 static struct checksum_driver checksum_drivers[] = {
 	{ "md5",    checksum_md5_new_checksum },
 	{ "sha1",   checksum_sha1_new_checksum },
 	{ "sha256", checksum_sha256_new_checksum },
 	{ "sha512", checksum_sha512_new_checksum },
+	{ "xxh3",   checksum_xxh3_new_checksum },
+	{ "xxh128", checksum_xxh128_new_checksum },
+	{ "crc32c", checksum_crc32c_new_checksum },
+	{ "blake3", checksum_blake3_new_checksum },
 
 	{ NULL, NULL },
 };
 
+#define CHECKSUM_NB_DRIVERS (sizeof(checksum_drivers) / sizeof(*checksum_drivers) - 1)
+
 static struct checksum_driver * checksum_default_driver = checksum_drivers;
 
+// drivers selected by --checksum when there are several of them
+static struct checksum_driver * checksum_default_drivers[CHECKSUM_NB_DRIVERS];
+static unsigned int checksum_nb_default_drivers = 0;
+static char checksum_list_name[256];
+static struct checksum_driver checksum_list_driver = { checksum_list_name, NULL };
+
+static void checksum_init(void);
+static struct checksum * checksum_new_list(void);
+
 
 void checksum_add(const char * digest, const char * path) {
 	if (checksum_fd >= 0)
@@ -77,10 +95,12 @@ bool checksum_create(const char * filename) {
 }
 
 struct checksum_driver * checksum_digests() {
+	pthread_once(&checksum_once, checksum_init);
 	return checksum_drivers;
 }
 
 struct checksum_driver * checksum_get_default() {
+	pthread_once(&checksum_once, checksum_init);
 	return checksum_default_driver;
 }
 
@@ -88,6 +108,31 @@ bool checksum_has_checksum_file() {
 	return checksum_fd > -1;
 }
 
+/**
+ * Drivers keep their name, only the implementation is replaced when the cpu
+ * has instructions for it, so digests are the same on every host.
+ * One SHA-NI stream is faster than one of the eight AVX2 lanes, so sha256
+ * only goes multi-buffer without SHA-NI. md5 stays on nettle.
+ */
+static void checksum_init() {
+	bool sha_ni = checksum_has_sha_ni();
+	bool avx2 = checksum_has_avx2();
+
+	struct checksum_driver * driver;
+	for (driver = checksum_drivers; driver->name != NULL; driver++) {
+		if (driver->new_checksum == checksum_sha1_new_checksum && sha_ni)
+			driver->new_checksum = checksum_sha1_ni_new_checksum;
+		else if (driver->new_checksum == checksum_sha256_new_checksum && sha_ni)
+			driver->new_checksum = checksum_sha256_ni_new_checksum;
+		else if (driver->new_checksum == checksum_sha256_new_checksum && avx2)
+			driver->new_checksum = checksum_sha256_multi_new_checksum;
+	}
+}
+
+static struct checksum * checksum_new_list() {
+	return checksum_list_new(checksum_default_drivers, checksum_nb_default_drivers);
+}
+
 bool checksum_parse(char ** digest, char ** path) {
 	static char buffer[16384];
 	static ssize_t nb_buffer_used = 0;
@@ -137,17 +182,76 @@ void checksum_rewind() {
 	lseek(checksum_fd, 0, SEEK_SET);
 }
 
+/**
+ * <checksum> is a name of driver or a comma separated list of them. A list
+ * is seen as one driver named after it, which computes each digest in the
+ * same pass over the data.
+ */
 bool checksum_set_default(const char * checksum) {
-	if (checksum == NULL)
+	if (checksum == NULL || strlen(checksum) >= sizeof(checksum_list_name))
 		return false;
 
-	struct checksum_driver * driver = checksum_drivers;
-	for (; driver->name != NULL; driver++)
-		if (strcmp(checksum, driver->name) == 0) {
-			checksum_default_driver = driver;
-			return true;
-		}
+	pthread_once(&checksum_once, checksum_init);
 
-	return false;
+	struct checksum_driver * drivers[CHECKSUM_NB_DRIVERS];
+	unsigned int i, nb_drivers = 0;
+
+	const char * name = checksum;
+	for (;;) {
+		const char * comma = strchr(name, ',');
+		size_t length = comma != NULL ? (size_t) (comma - name) : strlen(name);
+
+		struct checksum_driver * driver = checksum_drivers;
+		for (; driver->name != NULL; driver++)
+			if (strlen(driver->name) == length && strncmp(name, driver->name, length) == 0)
+				break;
+
+		if (driver->name == NULL)
+			return false;
+
+		// a digest given twice is computed once
+		for (i = 0; i < nb_drivers; i++)
+			if (drivers[i] == driver)
+				break;
+		if (i == nb_drivers)
+			drivers[nb_drivers++] = driver;
+
+		if (comma == NULL)
+			break;
+		name = comma + 1;
+	}
+
+	if (nb_drivers == 1) {
+		checksum_default_driver = drivers[0];
+		return true;
+	}
+
+	memcpy(checksum_default_drivers, drivers, nb_drivers * sizeof(struct checksum_driver *));
+	checksum_nb_default_drivers = nb_drivers;
+
+	checksum_list_name[0] = '\0';
+	for (i = 0; i < nb_drivers; i++) {
+		if (i > 0)
+			strcat(checksum_list_name, ",");
+		strcat(checksum_list_name, drivers[i]->name);
+	}
+
+	checksum_list_driver.new_checksum = checksum_new_list;
+	checksum_default_driver = &checksum_list_driver;
+
+	return true;
 }
 
+/**
+ * Hashes <length> bytes of <buffer>, a buffer of buffer_get(), and returns
+ * the buffer the caller owns afterwards. A checksum which keeps data for
+ * later takes <buffer> as it is and gives back another one of the pool,
+ * others are updated in place and <buffer> is returned.
+ */
+char * checksum_update_buffer(struct checksum * checksum, char * buffer, ssize_t length) {
+	if (checksum->ops->update_buffer != NULL)
+		return checksum->ops->update_buffer(checksum, buffer, length);
+
+	checksum->ops->update(checksum, buffer, length);
+	return buffer;
+}
@@ -42,6 +42,8 @@ struct checksum {
 		char * (*digest)(struct checksum * checksum) __attribute__((warn_unused_result));
 		void (*free)(struct checksum * checksum);
 		ssize_t (*update)(struct checksum * checksum, const void * data, ssize_t length);
+		// optional, see checksum_update_buffer()
+		char * (*update_buffer)(struct checksum * checksum, char * buffer, ssize_t length) __attribute__((warn_unused_result));
 	} * ops;
 
 	void * data;
@@ -58,8 +60,11 @@ struct checksum_driver * checksum_digests(void);
 struct checksum_driver * checksum_get_default(void);
 bool checksum_has_checksum_file(void);
 bool checksum_parse(char ** digest, char ** path);
+struct checksum * checksum_list_new(struct checksum_driver ** drivers, unsigned int nb_drivers) __attribute__((warn_unused_result));
+struct checksum * checksum_pipeline_new(struct checksum * checksum, unsigned int nb_buffers) __attribute__((warn_unused_result));
 void checksum_rewind(void);
 bool checksum_set_default(const char * checksum);
+char * checksum_update_buffer(struct checksum * checksum, char * buffer, ssize_t length) __attribute__((warn_unused_result));
 
 #endif
 
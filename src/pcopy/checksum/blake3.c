@@ -0,0 +1,631 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+// _mm256_*
+#include <immintrin.h>
+#endif
+// pthread_cond_broadcast, pthread_cond_destroy, pthread_cond_init,
+// pthread_cond_wait, pthread_mutex_destroy, pthread_mutex_init,
+// pthread_mutex_lock, pthread_mutex_unlock, pthread_once
+#include <pthread.h>
+// uint8_t, uint32_t, uint64_t
+#include <stdint.h>
+// free, malloc
+#include <stdlib.h>
+// memcpy, memset, strdup
+#include <string.h>
+
+#include "../thread.h"
+#include "digest.h"
+
+#define CHECKSUM_BLAKE3_BLOCK_SIZE 64
+#define CHECKSUM_BLAKE3_CHUNK_SIZE 1024
+#define CHECKSUM_BLAKE3_MAX_DEPTH 54
+// subtrees up to this size are hashed chunk by chunk, bigger ones are split in halves
+#define CHECKSUM_BLAKE3_LEAF_SIZE (16 * CHECKSUM_BLAKE3_CHUNK_SIZE)
+// smallest part of a subtree handed over to another thread
+#define CHECKSUM_BLAKE3_PART_SIZE (128 * CHECKSUM_BLAKE3_CHUNK_SIZE)
+#define CHECKSUM_BLAKE3_MAX_PARTS 16
+
+#define CHECKSUM_BLAKE3_CHUNK_START 1
+#define CHECKSUM_BLAKE3_CHUNK_END 2
+#define CHECKSUM_BLAKE3_PARENT 4
+#define CHECKSUM_BLAKE3_ROOT 8
+
+struct checksum_blake3_chunk {
+	uint32_t cv[8];
+	uint64_t counter;
+	uint8_t block[CHECKSUM_BLAKE3_BLOCK_SIZE];
+	unsigned int block_length;
+	unsigned int nb_blocks;
+};
+
+/**
+ * Last compression of a node, kept apart until we know whether this node
+ * is the root
+ */
+struct checksum_blake3_output {
+	uint32_t cv[8];
+	uint32_t block[16];
+	uint64_t counter;
+	unsigned int block_length;
+	unsigned int flags;
+};
+
+/**
+ * Chaining values of complete subtrees wait in a stack, they are merged
+ * lazily because the last one may end up as the root
+ */
+struct checksum_blake3 {
+	struct checksum_blake3_chunk chunk;
+	uint32_t stack[CHECKSUM_BLAKE3_MAX_DEPTH][8];
+	unsigned int stack_length;
+
+	char digest[65];
+};
+
+/**
+ * Parts of a big subtree are taken one by one by the hashing job and by the
+ * pool threads which were sleeping. The job only waits for the parts, a
+ * helper which starts late finds nothing to do and drops its reference.
+ */
+struct checksum_blake3_task {
+	const uint8_t * data;
+	size_t part_size;
+	uint64_t counter;
+	unsigned int nb_parts;
+
+	unsigned int next;
+	unsigned int nb_done;
+	unsigned int nb_refs;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+
+	uint32_t cvs[CHECKSUM_BLAKE3_MAX_PARTS][8];
+};
+
+static void checksum_blake3_chunk_cvs(const uint8_t * data, size_t nb_chunks, uint64_t counter, uint32_t (*cvs)[8]);
+static void checksum_blake3_chunk_output(const struct checksum_blake3_chunk * chunk, struct checksum_blake3_output * output);
+static void checksum_blake3_chunk_update(struct checksum_blake3_chunk * chunk, const uint8_t * data, size_t length);
+static void checksum_blake3_compress(const uint32_t * cv, const uint32_t * block, uint64_t counter, unsigned int block_length, unsigned int flags, uint32_t * out);
+static char * checksum_blake3_digest(struct checksum * checksum);
+static void checksum_blake3_free(struct checksum * checksum);
+#if defined(__x86_64__) || defined(__i386__)
+static void checksum_blake3_hash8_avx2(const uint8_t * data, uint64_t counter, uint32_t (*cvs)[8]) __attribute__((target("avx2")));
+#endif
+static void checksum_blake3_help(void * arg);
+static void checksum_blake3_init(void);
+static void checksum_blake3_load_block(const uint8_t * data, uint32_t * block);
+static void checksum_blake3_output_cv(const struct checksum_blake3_output * output, uint32_t * cv);
+static void checksum_blake3_parent_cv(const uint32_t * left, const uint32_t * right, uint32_t * cv);
+static void checksum_blake3_parent_output(const uint32_t * left, const uint32_t * right, struct checksum_blake3_output * output);
+static void checksum_blake3_push(struct checksum_blake3 * self, const uint32_t * cv, uint64_t nb_chunks);
+static void checksum_blake3_release(struct checksum_blake3_task * task);
+static void checksum_blake3_run_parts(struct checksum_blake3_task * task);
+static void checksum_blake3_subtree_cv(const uint8_t * data, size_t length, uint64_t counter, uint32_t * cv);
+static void checksum_blake3_subtree_halves(const uint8_t * data, size_t length, uint64_t counter, uint32_t * left, uint32_t * right);
+static ssize_t checksum_blake3_update(struct checksum * checksum, const void * data, ssize_t length);
+
+static struct checksum_ops checksum_blake3_ops = {
+	.digest = checksum_blake3_digest,
+	.free   = checksum_blake3_free,
+	.update = checksum_blake3_update,
+};
+
+static const uint32_t checksum_blake3_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// words of the message used by each round
+static const unsigned char checksum_blake3_schedule[7][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+	{  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+	{ 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+	{ 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+	{  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+	{ 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+static pthread_once_t checksum_blake3_once = PTHREAD_ONCE_INIT;
+static bool checksum_blake3_avx2 = false;
+
+
+static void checksum_blake3_chunk_cvs(const uint8_t * data, size_t nb_chunks, uint64_t counter, uint32_t (*cvs)[8]) {
+	size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (checksum_blake3_avx2)
+		for (; i + 8 <= nb_chunks; i += 8)
+			checksum_blake3_hash8_avx2(data + i * CHECKSUM_BLAKE3_CHUNK_SIZE, counter + i, cvs + i);
+#endif
+
+	for (; i < nb_chunks; i++) {
+		struct checksum_blake3_chunk chunk = { .counter = counter + i };
+		memcpy(chunk.cv, checksum_blake3_iv, sizeof(chunk.cv));
+		checksum_blake3_chunk_update(&chunk, data + i * CHECKSUM_BLAKE3_CHUNK_SIZE, CHECKSUM_BLAKE3_CHUNK_SIZE);
+
+		struct checksum_blake3_output output;
+		checksum_blake3_chunk_output(&chunk, &output);
+		checksum_blake3_output_cv(&output, cvs[i]);
+	}
+}
+
+static void checksum_blake3_chunk_output(const struct checksum_blake3_chunk * chunk, struct checksum_blake3_output * output) {
+	memcpy(output->cv, chunk->cv, sizeof(output->cv));
+
+	uint8_t block[CHECKSUM_BLAKE3_BLOCK_SIZE];
+	memcpy(block, chunk->block, chunk->block_length);
+	memset(block + chunk->block_length, 0, CHECKSUM_BLAKE3_BLOCK_SIZE - chunk->block_length);
+	checksum_blake3_load_block(block, output->block);
+
+	output->counter = chunk->counter;
+	output->block_length = chunk->block_length;
+	output->flags = (chunk->nb_blocks == 0 ? CHECKSUM_BLAKE3_CHUNK_START : 0) | CHECKSUM_BLAKE3_CHUNK_END;
+}
+
+static void checksum_blake3_chunk_update(struct checksum_blake3_chunk * chunk, const uint8_t * data, size_t length) {
+	while (length > 0) {
+		// the last block is compressed by the output, with its flags
+		if (chunk->block_length == CHECKSUM_BLAKE3_BLOCK_SIZE) {
+			uint32_t block[16], out[16];
+			checksum_blake3_load_block(chunk->block, block);
+			checksum_blake3_compress(chunk->cv, block, chunk->counter, CHECKSUM_BLAKE3_BLOCK_SIZE, chunk->nb_blocks == 0 ? CHECKSUM_BLAKE3_CHUNK_START : 0, out);
+			memcpy(chunk->cv, out, sizeof(chunk->cv));
+
+			chunk->nb_blocks++;
+			chunk->block_length = 0;
+		}
+
+		size_t nb_copy = CHECKSUM_BLAKE3_BLOCK_SIZE - chunk->block_length;
+		if (nb_copy > length)
+			nb_copy = length;
+
+		memcpy(chunk->block + chunk->block_length, data, nb_copy);
+		chunk->block_length += nb_copy;
+		data += nb_copy;
+		length -= nb_copy;
+	}
+}
+
+#define CHECKSUM_BLAKE3_ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+#define CHECKSUM_BLAKE3_G(v, a, b, c, d, x, y) \
+	do { \
+		v[a] += v[b] + (x); \
+		v[d] = CHECKSUM_BLAKE3_ROTR(v[d] ^ v[a], 16); \
+		v[c] += v[d]; \
+		v[b] = CHECKSUM_BLAKE3_ROTR(v[b] ^ v[c], 12); \
+		v[a] += v[b] + (y); \
+		v[d] = CHECKSUM_BLAKE3_ROTR(v[d] ^ v[a], 8); \
+		v[c] += v[d]; \
+		v[b] = CHECKSUM_BLAKE3_ROTR(v[b] ^ v[c], 7); \
+	} while (0)
+
+static void checksum_blake3_compress(const uint32_t * cv, const uint32_t * block, uint64_t counter, unsigned int block_length, unsigned int flags, uint32_t * out) {
+	uint32_t v[16] = {
+		cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+		checksum_blake3_iv[0], checksum_blake3_iv[1], checksum_blake3_iv[2], checksum_blake3_iv[3],
+		(uint32_t) counter, (uint32_t) (counter >> 32), block_length, flags,
+	};
+
+	unsigned int r;
+	for (r = 0; r < 7; r++) {
+		const unsigned char * s = checksum_blake3_schedule[r];
+		CHECKSUM_BLAKE3_G(v, 0, 4, 8, 12, block[s[0]], block[s[1]]);
+		CHECKSUM_BLAKE3_G(v, 1, 5, 9, 13, block[s[2]], block[s[3]]);
+		CHECKSUM_BLAKE3_G(v, 2, 6, 10, 14, block[s[4]], block[s[5]]);
+		CHECKSUM_BLAKE3_G(v, 3, 7, 11, 15, block[s[6]], block[s[7]]);
+		CHECKSUM_BLAKE3_G(v, 0, 5, 10, 15, block[s[8]], block[s[9]]);
+		CHECKSUM_BLAKE3_G(v, 1, 6, 11, 12, block[s[10]], block[s[11]]);
+		CHECKSUM_BLAKE3_G(v, 2, 7, 8, 13, block[s[12]], block[s[13]]);
+		CHECKSUM_BLAKE3_G(v, 3, 4, 9, 14, block[s[14]], block[s[15]]);
+	}
+
+	unsigned int i;
+	for (i = 0; i < 8; i++) {
+		out[i] = v[i] ^ v[i + 8];
+		out[i + 8] = v[i + 8] ^ cv[i];
+	}
+}
+
+static char * checksum_blake3_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_blake3 * self = checksum->data;
+	if (self->digest[0] != '\0')
+		return strdup(self->digest);
+
+	// the stack is only read, so more data could still be added
+	struct checksum_blake3_output output;
+	unsigned int nb_remaining = self->stack_length;
+	if (nb_remaining == 0 || self->chunk.nb_blocks > 0 || self->chunk.block_length > 0)
+		checksum_blake3_chunk_output(&self->chunk, &output);
+	else {
+		nb_remaining -= 2;
+		checksum_blake3_parent_output(self->stack[nb_remaining], self->stack[nb_remaining + 1], &output);
+	}
+
+	while (nb_remaining > 0) {
+		uint32_t cv[8];
+		checksum_blake3_output_cv(&output, cv);
+
+		nb_remaining--;
+		checksum_blake3_parent_output(self->stack[nb_remaining], cv, &output);
+	}
+
+	uint32_t out[16];
+	checksum_blake3_compress(output.cv, output.block, 0, output.block_length, output.flags | CHECKSUM_BLAKE3_ROOT, out);
+
+	unsigned char digest[32];
+	unsigned int i;
+	for (i = 0; i < 32; i++)
+		digest[i] = out[i / 4] >> (8 * (i % 4));
+
+	digest_convert_to_hex(digest, 32, self->digest);
+
+	return strdup(self->digest);
+}
+
+static void checksum_blake3_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	free(checksum->data);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_BLAKE3_ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define CHECKSUM_BLAKE3_G8(v, a, b, c, d, x, y) \
+	do { \
+		v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (x)); \
+		v[d] = CHECKSUM_BLAKE3_ROTR8(_mm256_xor_si256(v[d], v[a]), 16); \
+		v[c] = _mm256_add_epi32(v[c], v[d]); \
+		v[b] = CHECKSUM_BLAKE3_ROTR8(_mm256_xor_si256(v[b], v[c]), 12); \
+		v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (y)); \
+		v[d] = CHECKSUM_BLAKE3_ROTR8(_mm256_xor_si256(v[d], v[a]), 8); \
+		v[c] = _mm256_add_epi32(v[c], v[d]); \
+		v[b] = CHECKSUM_BLAKE3_ROTR8(_mm256_xor_si256(v[b], v[c]), 7); \
+	} while (0)
+
+/**
+ * Eight consecutive chunks, one in each lane
+ */
+static void checksum_blake3_hash8_avx2(const uint8_t * data, uint64_t counter, uint32_t (*cvs)[8]) {
+	uint32_t words[8][16];
+	__m256i cv[8], m[16], v[16];
+	unsigned int i, lane, block;
+
+	for (i = 0; i < 8; i++)
+		cv[i] = _mm256_set1_epi32(checksum_blake3_iv[i]);
+
+	const __m256i counter_low = _mm256_setr_epi32(counter, counter + 1, counter + 2, counter + 3, counter + 4, counter + 5, counter + 6, counter + 7);
+	const __m256i counter_high = _mm256_setr_epi32((counter) >> 32, (counter + 1) >> 32, (counter + 2) >> 32, (counter + 3) >> 32, (counter + 4) >> 32, (counter + 5) >> 32, (counter + 6) >> 32, (counter + 7) >> 32);
+
+	for (block = 0; block < CHECKSUM_BLAKE3_CHUNK_SIZE / CHECKSUM_BLAKE3_BLOCK_SIZE; block++) {
+		for (lane = 0; lane < 8; lane++)
+			checksum_blake3_load_block(data + lane * CHECKSUM_BLAKE3_CHUNK_SIZE + block * CHECKSUM_BLAKE3_BLOCK_SIZE, words[lane]);
+
+		// words[lane][i] becomes m[i] of each lane
+		for (i = 0; i < 16; i++)
+			m[i] = _mm256_setr_epi32(words[0][i], words[1][i], words[2][i], words[3][i], words[4][i], words[5][i], words[6][i], words[7][i]);
+
+		unsigned int flags = 0;
+		if (block == 0)
+			flags |= CHECKSUM_BLAKE3_CHUNK_START;
+		if (block == CHECKSUM_BLAKE3_CHUNK_SIZE / CHECKSUM_BLAKE3_BLOCK_SIZE - 1)
+			flags |= CHECKSUM_BLAKE3_CHUNK_END;
+
+		for (i = 0; i < 8; i++)
+			v[i] = cv[i];
+		for (i = 0; i < 4; i++)
+			v[i + 8] = _mm256_set1_epi32(checksum_blake3_iv[i]);
+		v[12] = counter_low;
+		v[13] = counter_high;
+		v[14] = _mm256_set1_epi32(CHECKSUM_BLAKE3_BLOCK_SIZE);
+		v[15] = _mm256_set1_epi32(flags);
+
+		unsigned int r;
+		for (r = 0; r < 7; r++) {
+			const unsigned char * s = checksum_blake3_schedule[r];
+			CHECKSUM_BLAKE3_G8(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			CHECKSUM_BLAKE3_G8(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			CHECKSUM_BLAKE3_G8(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			CHECKSUM_BLAKE3_G8(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			CHECKSUM_BLAKE3_G8(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			CHECKSUM_BLAKE3_G8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			CHECKSUM_BLAKE3_G8(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			CHECKSUM_BLAKE3_G8(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (i = 0; i < 8; i++)
+			cv[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+
+	uint32_t out[8][8] __attribute__((aligned(32)));
+	for (i = 0; i < 8; i++)
+		_mm256_store_si256((__m256i *) out[i], cv[i]);
+	for (lane = 0; lane < 8; lane++)
+		for (i = 0; i < 8; i++)
+			cvs[lane][i] = out[i][lane];
+}
+#endif
+
+static void checksum_blake3_help(void * arg) {
+	struct checksum_blake3_task * task = arg;
+	checksum_blake3_run_parts(task);
+	checksum_blake3_release(task);
+}
+
+static void checksum_blake3_init() {
+#if defined(__x86_64__) || defined(__i386__)
+	checksum_blake3_avx2 = checksum_has_avx2();
+#endif
+}
+
+static void checksum_blake3_load_block(const uint8_t * data, uint32_t * block) {
+	unsigned int i;
+	for (i = 0; i < 16; i++)
+		block[i] = (uint32_t) data[4 * i] | (uint32_t) data[4 * i + 1] << 8 | (uint32_t) data[4 * i + 2] << 16 | (uint32_t) data[4 * i + 3] << 24;
+}
+
+struct checksum * checksum_blake3_new_checksum() {
+	pthread_once(&checksum_blake3_once, checksum_blake3_init);
+
+	struct checksum * checksum = malloc(sizeof(struct checksum));
+	checksum->ops = &checksum_blake3_ops;
+
+	struct checksum_blake3 * self = malloc(sizeof(struct checksum_blake3));
+	memcpy(self->chunk.cv, checksum_blake3_iv, sizeof(self->chunk.cv));
+	self->chunk.counter = 0;
+	self->chunk.block_length = 0;
+	self->chunk.nb_blocks = 0;
+	self->stack_length = 0;
+	*self->digest = '\0';
+
+	checksum->data = self;
+	return checksum;
+}
+
+static void checksum_blake3_output_cv(const struct checksum_blake3_output * output, uint32_t * cv) {
+	uint32_t out[16];
+	checksum_blake3_compress(output->cv, output->block, output->counter, output->block_length, output->flags, out);
+	memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void checksum_blake3_parent_cv(const uint32_t * left, const uint32_t * right, uint32_t * cv) {
+	struct checksum_blake3_output output;
+	checksum_blake3_parent_output(left, right, &output);
+	checksum_blake3_output_cv(&output, cv);
+}
+
+static void checksum_blake3_parent_output(const uint32_t * left, const uint32_t * right, struct checksum_blake3_output * output) {
+	memcpy(output->cv, checksum_blake3_iv, sizeof(output->cv));
+	memcpy(output->block, left, 8 * sizeof(uint32_t));
+	memcpy(output->block + 8, right, 8 * sizeof(uint32_t));
+	output->counter = 0;
+	output->block_length = CHECKSUM_BLAKE3_BLOCK_SIZE;
+	output->flags = CHECKSUM_BLAKE3_PARENT;
+}
+
+/**
+ * <nb_chunks> chunks precede this chaining value, the stack then holds one
+ * entry per bit set in it
+ */
+static void checksum_blake3_push(struct checksum_blake3 * self, const uint32_t * cv, uint64_t nb_chunks) {
+	unsigned int nb_entries = __builtin_popcountll(nb_chunks);
+	while (self->stack_length > nb_entries) {
+		self->stack_length--;
+		checksum_blake3_parent_cv(self->stack[self->stack_length - 1], self->stack[self->stack_length], self->stack[self->stack_length - 1]);
+	}
+
+	memcpy(self->stack[self->stack_length], cv, 8 * sizeof(uint32_t));
+	self->stack_length++;
+}
+
+static void checksum_blake3_release(struct checksum_blake3_task * task) {
+	if (__atomic_sub_fetch(&task->nb_refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	pthread_cond_destroy(&task->wait);
+	pthread_mutex_destroy(&task->lock);
+	free(task);
+}
+
+static void checksum_blake3_run_parts(struct checksum_blake3_task * task) {
+	unsigned int i;
+	while (i = __atomic_fetch_add(&task->next, 1, __ATOMIC_ACQ_REL), i < task->nb_parts) {
+		checksum_blake3_subtree_cv(task->data + i * task->part_size, task->part_size, task->counter + i * (task->part_size / CHECKSUM_BLAKE3_CHUNK_SIZE), task->cvs[i]);
+
+		pthread_mutex_lock(&task->lock);
+		task->nb_done++;
+		if (task->nb_done == task->nb_parts)
+			pthread_cond_broadcast(&task->wait);
+		pthread_mutex_unlock(&task->lock);
+	}
+}
+
+/**
+ * <length> is a power of two number of chunks
+ */
+static void checksum_blake3_subtree_cv(const uint8_t * data, size_t length, uint64_t counter, uint32_t * cv) {
+	if (length > CHECKSUM_BLAKE3_LEAF_SIZE) {
+		uint32_t left[8], right[8];
+		checksum_blake3_subtree_halves(data, length, counter, left, right);
+		checksum_blake3_parent_cv(left, right, cv);
+		return;
+	}
+
+	uint32_t cvs[CHECKSUM_BLAKE3_LEAF_SIZE / CHECKSUM_BLAKE3_CHUNK_SIZE][8];
+	size_t i, nb_cvs = length / CHECKSUM_BLAKE3_CHUNK_SIZE;
+	checksum_blake3_chunk_cvs(data, nb_cvs, counter, cvs);
+
+	for (; nb_cvs > 1; nb_cvs /= 2)
+		for (i = 0; i < nb_cvs / 2; i++)
+			checksum_blake3_parent_cv(cvs[2 * i], cvs[2 * i + 1], cvs[i]);
+
+	memcpy(cv, cvs[0], 8 * sizeof(uint32_t));
+}
+
+/**
+ * Chaining values of both halves of a subtree, which is at least two chunks.
+ * Big subtrees are cut in parts shared with sleeping threads of the pool.
+ */
+static void checksum_blake3_subtree_halves(const uint8_t * data, size_t length, uint64_t counter, uint32_t * left, uint32_t * right) {
+	size_t half = length / 2;
+
+	struct checksum_blake3_task * task = NULL;
+	if (length >= 2 * CHECKSUM_BLAKE3_PART_SIZE)
+		task = malloc(sizeof(struct checksum_blake3_task));
+
+	if (task == NULL) {
+		checksum_blake3_subtree_cv(data, half, counter, left);
+		checksum_blake3_subtree_cv(data + half, half, counter + half / CHECKSUM_BLAKE3_CHUNK_SIZE, right);
+		return;
+	}
+
+	task->nb_parts = length / CHECKSUM_BLAKE3_PART_SIZE;
+	if (task->nb_parts > CHECKSUM_BLAKE3_MAX_PARTS)
+		task->nb_parts = CHECKSUM_BLAKE3_MAX_PARTS;
+
+	task->data = data;
+	task->part_size = length / task->nb_parts;
+	task->counter = counter;
+	task->next = task->nb_done = 0;
+	task->nb_refs = 1;
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->wait, NULL);
+
+	unsigned int i;
+	for (i = 1; i < task->nb_parts; i++) {
+		__atomic_add_fetch(&task->nb_refs, 1, __ATOMIC_ACQ_REL);
+		if (thread_pool_try_run("blake3", checksum_blake3_help, task) != 0) {
+			__atomic_sub_fetch(&task->nb_refs, 1, __ATOMIC_ACQ_REL);
+			break;
+		}
+	}
+
+	checksum_blake3_run_parts(task);
+
+	pthread_mutex_lock(&task->lock);
+	while (task->nb_done < task->nb_parts)
+		pthread_cond_wait(&task->wait, &task->lock);
+	pthread_mutex_unlock(&task->lock);
+
+	unsigned int nb_cvs;
+	for (nb_cvs = task->nb_parts; nb_cvs > 2; nb_cvs /= 2)
+		for (i = 0; i < nb_cvs / 2; i++)
+			checksum_blake3_parent_cv(task->cvs[2 * i], task->cvs[2 * i + 1], task->cvs[i]);
+
+	memcpy(left, task->cvs[0], 8 * sizeof(uint32_t));
+	memcpy(right, task->cvs[1], 8 * sizeof(uint32_t));
+
+	checksum_blake3_release(task);
+}
+
+static ssize_t checksum_blake3_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_blake3 * self = checksum->data;
+	const uint8_t * ptr = data;
+	size_t left = length;
+
+	// complete the current chunk, it is only closed when more data follows
+	size_t chunk_length = self->chunk.nb_blocks * CHECKSUM_BLAKE3_BLOCK_SIZE + self->chunk.block_length;
+	if (chunk_length > 0) {
+		size_t nb_copy = CHECKSUM_BLAKE3_CHUNK_SIZE - chunk_length;
+		if (nb_copy > left)
+			nb_copy = left;
+
+		checksum_blake3_chunk_update(&self->chunk, ptr, nb_copy);
+		ptr += nb_copy;
+		left -= nb_copy;
+
+		if (left == 0)
+			return length;
+
+		struct checksum_blake3_output output;
+		uint32_t cv[8];
+		checksum_blake3_chunk_output(&self->chunk, &output);
+		checksum_blake3_output_cv(&output, cv);
+		checksum_blake3_push(self, cv, self->chunk.counter);
+
+		memcpy(self->chunk.cv, checksum_blake3_iv, sizeof(self->chunk.cv));
+		self->chunk.counter++;
+		self->chunk.block_length = 0;
+		self->chunk.nb_blocks = 0;
+	}
+
+	// then the biggest subtrees aligned on what was already hashed
+	while (left > CHECKSUM_BLAKE3_CHUNK_SIZE) {
+		size_t subtree = (size_t) 1 << (63 - __builtin_clzll(left));
+		uint64_t position = self->chunk.counter * CHECKSUM_BLAKE3_CHUNK_SIZE;
+		while (((subtree - 1) & position) != 0)
+			subtree /= 2;
+
+		uint64_t nb_chunks = subtree / CHECKSUM_BLAKE3_CHUNK_SIZE;
+		if (nb_chunks == 1) {
+			uint32_t cv[1][8];
+			checksum_blake3_chunk_cvs(ptr, 1, self->chunk.counter, cv);
+			checksum_blake3_push(self, cv[0], self->chunk.counter);
+		} else {
+			uint32_t cv_left[8], cv_right[8];
+			checksum_blake3_subtree_halves(ptr, subtree, self->chunk.counter, cv_left, cv_right);
+			checksum_blake3_push(self, cv_left, self->chunk.counter);
+			checksum_blake3_push(self, cv_right, self->chunk.counter + nb_chunks / 2);
+		}
+
+		self->chunk.counter += nb_chunks;
+		ptr += subtree;
+		left -= subtree;
+	}
+
+	if (left > 0) {
+		checksum_blake3_chunk_update(&self->chunk, ptr, left);
+
+		// the stack is merged now, as the digest does not know the number of chunks
+		while (self->stack_length > (unsigned int) __builtin_popcountll(self->chunk.counter)) {
+			self->stack_length--;
+			checksum_blake3_parent_cv(self->stack[self->stack_length - 1], self->stack[self->stack_length], self->stack[self->stack_length - 1]);
+		}
+	}
+
+	return length;
+}
+
@@ -0,0 +1,218 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#if defined(__x86_64__)
+// __get_cpuid
+#include <cpuid.h>
+// _mm_clmulepi64_si128, _mm_crc32_u64, _mm_crc32_u8
+#include <immintrin.h>
+#endif
+// pthread_once
+#include <pthread.h>
+// uint8_t, uint32_t, uint64_t
+#include <stdint.h>
+// free, malloc
+#include <stdlib.h>
+// memcpy, strdup
+#include <string.h>
+
+#include "digest.h"
+
+// Castagnoli polynomial, bit reflected
+#define CHECKSUM_CRC32C_POLYNOMIAL 0x82F63B78U
+// bytes hashed by each of the three interleaved streams
+#define CHECKSUM_CRC32C_STREAM_SIZE 1024
+
+struct checksum_crc32c {
+	uint32_t crc;
+	char digest[9];
+};
+
+static char * checksum_crc32c_digest(struct checksum * checksum);
+static void checksum_crc32c_free(struct checksum * checksum);
+#if defined(__x86_64__)
+static uint32_t checksum_crc32c_hardware(uint32_t crc, const uint8_t * data, size_t length) __attribute__((target("sse4.2,pclmul")));
+static uint32_t checksum_crc32c_hardware_shift(uint32_t crc, uint32_t constant) __attribute__((target("sse4.2,pclmul")));
+#endif
+static void checksum_crc32c_init(void);
+static uint32_t checksum_crc32c_power(unsigned int exponent);
+static uint32_t checksum_crc32c_software(uint32_t crc, const uint8_t * data, size_t length);
+static ssize_t checksum_crc32c_update(struct checksum * checksum, const void * data, ssize_t length);
+
+static struct checksum_ops checksum_crc32c_ops = {
+	.digest = checksum_crc32c_digest,
+	.free   = checksum_crc32c_free,
+	.update = checksum_crc32c_update,
+};
+
+static pthread_once_t checksum_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t checksum_crc32c_table[256];
+static uint32_t checksum_crc32c_shift_1, checksum_crc32c_shift_2;
+static uint32_t (*checksum_crc32c_update_crc)(uint32_t crc, const uint8_t * data, size_t length) = checksum_crc32c_software;
+
+
+static char * checksum_crc32c_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_crc32c * self = checksum->data;
+	if (self->digest[0] != '\0')
+		return strdup(self->digest);
+
+	uint32_t crc = ~self->crc;
+	unsigned char digest[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+	digest_convert_to_hex(digest, 4, self->digest);
+
+	return strdup(self->digest);
+}
+
+static void checksum_crc32c_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	free(checksum->data);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+#if defined(__x86_64__)
+/**
+ * crc32 has a latency of three cycles but a new one can start each cycle,
+ * so three parts of the data are hashed at once and their crcs are merged
+ * by carry-less multiplications
+ */
+static uint32_t checksum_crc32c_hardware(uint32_t crc, const uint8_t * data, size_t length) {
+	uint64_t crc0 = crc;
+
+	for (; length > 0 && ((uintptr_t) data & 7) != 0; data++, length--)
+		crc0 = _mm_crc32_u8(crc0, *data);
+
+	while (length >= 3 * CHECKSUM_CRC32C_STREAM_SIZE) {
+		uint64_t crc1 = 0, crc2 = 0, value;
+		const uint8_t * end = data + CHECKSUM_CRC32C_STREAM_SIZE;
+
+		for (; data < end; data += 8) {
+			memcpy(&value, data, 8);
+			crc0 = _mm_crc32_u64(crc0, value);
+			memcpy(&value, data + CHECKSUM_CRC32C_STREAM_SIZE, 8);
+			crc1 = _mm_crc32_u64(crc1, value);
+			memcpy(&value, data + 2 * CHECKSUM_CRC32C_STREAM_SIZE, 8);
+			crc2 = _mm_crc32_u64(crc2, value);
+		}
+
+		crc0 = checksum_crc32c_hardware_shift(crc0, checksum_crc32c_shift_2) ^ checksum_crc32c_hardware_shift(crc1, checksum_crc32c_shift_1) ^ crc2;
+		data += 2 * CHECKSUM_CRC32C_STREAM_SIZE;
+		length -= 3 * CHECKSUM_CRC32C_STREAM_SIZE;
+	}
+
+	for (; length >= 8; data += 8, length -= 8) {
+		uint64_t value;
+		memcpy(&value, data, 8);
+		crc0 = _mm_crc32_u64(crc0, value);
+	}
+
+	for (; length > 0; data++, length--)
+		crc0 = _mm_crc32_u8(crc0, *data);
+
+	return crc0;
+}
+
+/**
+ * Multiply by x^(8n - 33) then let crc32 multiply by x^32 and reduce, the
+ * missing x comes from the product of two reflected operands
+ */
+static uint32_t checksum_crc32c_hardware_shift(uint32_t crc, uint32_t constant) {
+	__m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(constant), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+#endif
+
+static void checksum_crc32c_init() {
+	unsigned int i, j;
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CHECKSUM_CRC32C_POLYNOMIAL : crc >> 1;
+		checksum_crc32c_table[i] = crc;
+	}
+
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) && (ecx & bit_PCLMUL)) {
+		checksum_crc32c_shift_1 = checksum_crc32c_power(8 * CHECKSUM_CRC32C_STREAM_SIZE - 33);
+		checksum_crc32c_shift_2 = checksum_crc32c_power(16 * CHECKSUM_CRC32C_STREAM_SIZE - 33);
+		checksum_crc32c_update_crc = checksum_crc32c_hardware;
+	}
+#endif
+}
+
+struct checksum * checksum_crc32c_new_checksum() {
+	pthread_once(&checksum_crc32c_once, checksum_crc32c_init);
+
+	struct checksum * checksum = malloc(sizeof(struct checksum));
+	checksum->ops = &checksum_crc32c_ops;
+
+	struct checksum_crc32c * self = malloc(sizeof(struct checksum_crc32c));
+	self->crc = ~0U;
+	*self->digest = '\0';
+
+	checksum->data = self;
+	return checksum;
+}
+
+/**
+ * x^exponent modulo the polynomial, bit reflected
+ */
+static uint32_t checksum_crc32c_power(unsigned int exponent) {
+	uint32_t value = 0x80000000U;
+	for (; exponent > 0; exponent--)
+		value = value & 1 ? (value >> 1) ^ CHECKSUM_CRC32C_POLYNOMIAL : value >> 1;
+	return value;
+}
+
+static uint32_t checksum_crc32c_software(uint32_t crc, const uint8_t * data, size_t length) {
+	for (; length > 0; data++, length--)
+		crc = checksum_crc32c_table[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static ssize_t checksum_crc32c_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_crc32c * self = checksum->data;
+	self->crc = checksum_crc32c_update_crc(self->crc, data, length);
+	return length;
+}
+
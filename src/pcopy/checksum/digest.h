@@ -34,10 +34,20 @@
 
 #include "../checksum.h"
 
+struct checksum * checksum_blake3_new_checksum(void);
+struct checksum * checksum_crc32c_new_checksum(void);
 struct checksum * checksum_md5_new_checksum(void);
 struct checksum * checksum_sha1_new_checksum(void);
+struct checksum * checksum_sha1_ni_new_checksum(void);
 struct checksum * checksum_sha256_new_checksum(void);
+struct checksum * checksum_sha256_multi_new_checksum(void);
+struct checksum * checksum_sha256_ni_new_checksum(void);
 struct checksum * checksum_sha512_new_checksum(void);
+struct checksum * checksum_xxh128_new_checksum(void);
+struct checksum * checksum_xxh3_new_checksum(void);
+
+bool checksum_has_avx2(void);
+bool checksum_has_sha_ni(void);
 
 void digest_convert_to_hex(unsigned char * digest, ssize_t length, char * hex_digest);
 
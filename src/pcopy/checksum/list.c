@@ -0,0 +1,179 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#define _GNU_SOURCE
+// asprintf
+#include <stdio.h>
+// calloc, free, malloc
+#include <stdlib.h>
+
+#include "digest.h"
+
+/**
+ * Each slice is given to every checksum while it is still in the L2 cache,
+ * it remains big enough for blake3 to share it with idle threads
+ */
+#define CHECKSUM_LIST_SLICE (256 * 1024)
+
+/**
+ * A list computes several digests in the same pass over the data, its
+ * digest is 'name:digest' of each checksum separated by commas
+ */
+struct checksum_list {
+	struct checksum_driver ** drivers;
+	struct checksum ** checksums;
+	unsigned int nb_checksums;
+};
+
+static char * checksum_list_digest(struct checksum * checksum);
+static void checksum_list_free(struct checksum * checksum);
+static ssize_t checksum_list_update(struct checksum * checksum, const void * data, ssize_t length);
+
+static struct checksum_ops checksum_list_ops = {
+	.digest = checksum_list_digest,
+	.free   = checksum_list_free,
+	.update = checksum_list_update,
+};
+
+
+static char * checksum_list_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_list * self = checksum->data;
+
+	char * digest = NULL;
+	unsigned int i;
+	for (i = 0; i < self->nb_checksums; i++) {
+		char * part = self->checksums[i]->ops->digest(self->checksums[i]);
+		if (part == NULL) {
+			free(digest);
+			return NULL;
+		}
+
+		char * previous = digest;
+		int size;
+		if (previous == NULL)
+			size = asprintf(&digest, "%s:%s", self->drivers[i]->name, part);
+		else
+			size = asprintf(&digest, "%s,%s:%s", previous, self->drivers[i]->name, part);
+
+		free(previous);
+		free(part);
+
+		if (size < 0)
+			return NULL;
+	}
+
+	return digest;
+}
+
+static void checksum_list_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	struct checksum_list * self = checksum->data;
+
+	unsigned int i;
+	for (i = 0; i < self->nb_checksums; i++)
+		self->checksums[i]->ops->free(self->checksums[i]);
+	free(self->checksums);
+	free(self);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+struct checksum * checksum_list_new(struct checksum_driver ** drivers, unsigned int nb_drivers) {
+	if (drivers == NULL || nb_drivers < 1)
+		return NULL;
+
+	if (nb_drivers == 1)
+		return drivers[0]->new_checksum();
+
+	struct checksum_list * self = malloc(sizeof(struct checksum_list));
+	if (self == NULL)
+		return NULL;
+
+	self->drivers = drivers;
+	self->checksums = calloc(nb_drivers, sizeof(struct checksum *));
+	self->nb_checksums = nb_drivers;
+
+	struct checksum * checksum = malloc(sizeof(struct checksum));
+	if (self->checksums == NULL || checksum == NULL) {
+		free(checksum);
+		free(self->checksums);
+		free(self);
+		return NULL;
+	}
+
+	unsigned int i;
+	for (i = 0; i < nb_drivers; i++) {
+		self->checksums[i] = drivers[i]->new_checksum();
+		if (self->checksums[i] == NULL) {
+			while (i-- > 0)
+				self->checksums[i]->ops->free(self->checksums[i]);
+			free(checksum);
+			free(self->checksums);
+			free(self);
+			return NULL;
+		}
+	}
+
+	checksum->ops = &checksum_list_ops;
+	checksum->data = self;
+
+	return checksum;
+}
+
+static ssize_t checksum_list_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_list * self = checksum->data;
+
+	const char * ptr = data;
+	ssize_t offset;
+	for (offset = 0; offset < length; offset += CHECKSUM_LIST_SLICE) {
+		ssize_t nb_bytes = length - offset;
+		if (nb_bytes > CHECKSUM_LIST_SLICE)
+			nb_bytes = CHECKSUM_LIST_SLICE;
+
+		unsigned int i;
+		for (i = 0; i < self->nb_checksums; i++)
+			self->checksums[i]->ops->update(self->checksums[i], ptr + offset, nb_bytes);
+	}
+
+	return length;
+}
+
@@ -0,0 +1,611 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// __get_cpuid, __get_cpuid_count
+#include <cpuid.h>
+// _mm256_*
+#include <immintrin.h>
+// pthread_cond_broadcast, pthread_cond_wait, pthread_mutex_lock, pthread_mutex_unlock, pthread_once
+#include <pthread.h>
+// uint8_t, uint32_t, uint64_t
+#include <stdint.h>
+// free, malloc
+#include <stdlib.h>
+// memcpy, memset, strdup
+#include <string.h>
+
+#include "../util.h"
+#include "digest.h"
+
+#define CHECKSUM_MULTI_BLOCK_SIZE 64
+#define CHECKSUM_MULTI_NB_LANES 8
+// passes are kept short so that streams arriving meanwhile can join the next one
+#define CHECKSUM_MULTI_PASS_BLOCKS 64
+
+struct checksum_multi_algorithm {
+	unsigned int nb_words;
+	unsigned int digest_size;
+	bool big_endian;
+	const uint32_t * init;
+
+	// one block of one stream
+	void (*compress)(uint32_t * state, const uint8_t * data);
+	// one block of each lane, states are stored word by word
+	void (*kernel)(uint32_t (*states)[CHECKSUM_MULTI_NB_LANES], const uint8_t * const * data);
+};
+
+struct checksum_multi {
+	struct checksum_multi_service * service;
+
+	uint32_t state[8];
+	uint8_t block[CHECKSUM_MULTI_BLOCK_SIZE];
+	unsigned int index;
+	uint64_t length;
+
+	char digest[65];
+};
+
+/**
+ * A request lives on the stack of the job which waits for it
+ */
+struct checksum_multi_request {
+	struct checksum_multi * stream;
+	const uint8_t * data;
+	size_t nb_blocks;
+	bool queued;
+	bool done;
+
+	struct checksum_multi_request * next;
+};
+
+/**
+ * Jobs hashing with the same algorithm share one service. As long as there
+ * are no more streams than cpus, each job hashes its blocks in place. Beyond
+ * that, requests are queued and a job whose request finds no free lane in
+ * the running combiners becomes a combiner itself: it fills its lanes with
+ * pending requests, its own first, and runs them together until its own
+ * request is done. So there is one combiner for each eight queued streams
+ * and each of them runs on the thread of its own job.
+ */
+struct checksum_multi_service {
+	const struct checksum_multi_algorithm * algorithm;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	struct checksum_multi_request * first, * last;
+	unsigned int nb_queued;
+	// streams being hashed, in place or by a combiner
+	unsigned int nb_streams;
+	// lanes the running combiners can still fill
+	unsigned int nb_free_lanes;
+};
+
+static void checksum_multi_combine(struct checksum_multi_service * service, struct checksum_multi_request * request);
+static void checksum_multi_dequeue(struct checksum_multi_service * service, struct checksum_multi_request * request);
+static char * checksum_multi_digest(struct checksum * checksum);
+static void checksum_multi_free(struct checksum * checksum);
+static void checksum_multi_init(void);
+static struct checksum * checksum_multi_new(struct checksum_multi_service * service);
+static void checksum_multi_pass(const struct checksum_multi_algorithm * algorithm, struct checksum_multi_request ** lanes, unsigned int nb_active);
+static void checksum_multi_run(struct checksum_multi_service * service, struct checksum_multi_request * request);
+static ssize_t checksum_multi_update(struct checksum * checksum, const void * data, ssize_t length);
+static void checksum_sha256_multi_compress(uint32_t * state, const uint8_t * data);
+static void checksum_sha256_multi_kernel(uint32_t (*states)[CHECKSUM_MULTI_NB_LANES], const uint8_t * const * data) __attribute__((target("avx2")));
+
+static struct checksum_ops checksum_multi_ops = {
+	.digest = checksum_multi_digest,
+	.free   = checksum_multi_free,
+	.update = checksum_multi_update,
+};
+
+static const uint32_t checksum_sha256_multi_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t checksum_sha256_multi_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const struct checksum_multi_algorithm checksum_sha256_multi_algorithm = {
+	.nb_words    = 8,
+	.digest_size = 32,
+	.big_endian  = true,
+	.init        = checksum_sha256_multi_init,
+	.compress    = checksum_sha256_multi_compress,
+	.kernel      = checksum_sha256_multi_kernel,
+};
+
+static struct checksum_multi_service checksum_sha256_multi_service = {
+	.algorithm = &checksum_sha256_multi_algorithm,
+	.lock      = PTHREAD_MUTEX_INITIALIZER,
+	.wait      = PTHREAD_COND_INITIALIZER,
+};
+
+// idle lanes hash this block, their result is dropped
+static const uint8_t checksum_multi_idle_block[CHECKSUM_MULTI_BLOCK_SIZE];
+
+static pthread_once_t checksum_multi_once = PTHREAD_ONCE_INIT;
+static unsigned int checksum_multi_nb_cpus = 1;
+
+
+bool checksum_has_avx2() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return false;
+
+	// the kernel has to save ymm registers
+	unsigned int xcr0_lo, xcr0_hi;
+	__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	if ((xcr0_lo & 0x6) != 0x6)
+		return false;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return (ebx & bit_AVX2) != 0;
+}
+
+#define CHECKSUM_MULTI_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/**
+ * Called and returns with the lock of <service> held
+ */
+static void checksum_multi_combine(struct checksum_multi_service * service, struct checksum_multi_request * request) {
+	struct checksum_multi_request * lanes[CHECKSUM_MULTI_NB_LANES] = { request };
+	unsigned int i;
+
+	checksum_multi_dequeue(service, request);
+	service->nb_free_lanes += CHECKSUM_MULTI_NB_LANES - 1;
+
+	while (!request->done) {
+		unsigned int nb_active = 0;
+		for (i = 0; i < CHECKSUM_MULTI_NB_LANES; i++) {
+			if (lanes[i] == NULL && service->first != NULL) {
+				lanes[i] = service->first;
+				checksum_multi_dequeue(service, lanes[i]);
+				service->nb_free_lanes--;
+			}
+
+			if (lanes[i] != NULL)
+				nb_active++;
+		}
+
+		pthread_mutex_unlock(&service->lock);
+
+		checksum_multi_pass(service->algorithm, lanes, nb_active);
+
+		pthread_mutex_lock(&service->lock);
+
+		bool finished = false;
+		for (i = 0; i < CHECKSUM_MULTI_NB_LANES; i++)
+			if (lanes[i] != NULL && lanes[i]->nb_blocks == 0) {
+				lanes[i]->done = true;
+				lanes[i] = NULL;
+				service->nb_free_lanes++;
+				finished = true;
+			}
+
+		if (finished)
+			pthread_cond_broadcast(&service->wait);
+	}
+
+	// unfinished requests go back to the front of the queue for another combiner
+	for (i = CHECKSUM_MULTI_NB_LANES; i-- > 0;) {
+		if (lanes[i] == NULL)
+			continue;
+
+		lanes[i]->next = service->first;
+		service->first = lanes[i];
+		if (service->last == NULL)
+			service->last = lanes[i];
+		lanes[i]->queued = true;
+		service->nb_queued++;
+		service->nb_free_lanes++;
+	}
+
+	service->nb_free_lanes -= CHECKSUM_MULTI_NB_LANES;
+	pthread_cond_broadcast(&service->wait);
+}
+
+static void checksum_multi_dequeue(struct checksum_multi_service * service, struct checksum_multi_request * request) {
+	struct checksum_multi_request * previous = NULL, * current = service->first;
+	while (current != request) {
+		previous = current;
+		current = current->next;
+	}
+
+	if (previous != NULL)
+		previous->next = request->next;
+	else
+		service->first = request->next;
+
+	if (service->last == request)
+		service->last = previous;
+
+	request->next = NULL;
+	request->queued = false;
+	service->nb_queued--;
+}
+
+static char * checksum_multi_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_multi * self = checksum->data;
+	if (self->digest[0] != '\0')
+		return strdup(self->digest);
+
+	const struct checksum_multi_algorithm * algorithm = self->service->algorithm;
+
+	// padding is done on copies so more data could still be added
+	uint32_t state[8];
+	memcpy(state, self->state, sizeof(state));
+
+	uint8_t block[2 * CHECKSUM_MULTI_BLOCK_SIZE];
+	memcpy(block, self->block, self->index);
+	block[self->index] = 0x80;
+
+	unsigned int nb_blocks = self->index < CHECKSUM_MULTI_BLOCK_SIZE - 8 ? 1 : 2;
+	unsigned int end = nb_blocks * CHECKSUM_MULTI_BLOCK_SIZE;
+	memset(block + self->index + 1, 0, end - self->index - 1);
+
+	uint64_t nb_bits = self->length * 8;
+	unsigned int i;
+	for (i = 0; i < 8; i++)
+		block[algorithm->big_endian ? end - 1 - i : end - 8 + i] = nb_bits >> (8 * i);
+
+	for (i = 0; i < nb_blocks; i++)
+		algorithm->compress(state, block + i * CHECKSUM_MULTI_BLOCK_SIZE);
+
+	unsigned char digest[32];
+	for (i = 0; i < algorithm->digest_size; i++)
+		digest[i] = state[i / 4] >> (algorithm->big_endian ? 24 - 8 * (i % 4) : 8 * (i % 4));
+
+	digest_convert_to_hex(digest, algorithm->digest_size, self->digest);
+
+	return strdup(self->digest);
+}
+
+static void checksum_multi_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	free(checksum->data);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+static void checksum_multi_init() {
+	checksum_multi_nb_cpus = util_nb_cpus();
+}
+
+static struct checksum * checksum_multi_new(struct checksum_multi_service * service) {
+	struct checksum * checksum = malloc(sizeof(struct checksum));
+	checksum->ops = &checksum_multi_ops;
+
+	struct checksum_multi * self = malloc(sizeof(struct checksum_multi));
+	self->service = service;
+	memset(self->state, 0, sizeof(self->state));
+	memcpy(self->state, service->algorithm->init, service->algorithm->nb_words * sizeof(uint32_t));
+	self->index = 0;
+	self->length = 0;
+	*self->digest = '\0';
+
+	checksum->data = self;
+	return checksum;
+}
+
+static void checksum_multi_pass(const struct checksum_multi_algorithm * algorithm, struct checksum_multi_request ** lanes, unsigned int nb_active) {
+	struct checksum_multi_request * request;
+	unsigned int i, j;
+
+	// a lone stream is not worth a kernel for eight
+	if (nb_active == 1) {
+		for (i = 0; lanes[i] == NULL; i++);
+		request = lanes[i];
+
+		size_t nb_blocks = request->nb_blocks < CHECKSUM_MULTI_PASS_BLOCKS ? request->nb_blocks : CHECKSUM_MULTI_PASS_BLOCKS;
+		for (j = 0; j < nb_blocks; j++, request->data += CHECKSUM_MULTI_BLOCK_SIZE)
+			algorithm->compress(request->stream->state, request->data);
+		request->nb_blocks -= nb_blocks;
+		return;
+	}
+
+	uint32_t states[8][CHECKSUM_MULTI_NB_LANES];
+	const uint8_t * data[CHECKSUM_MULTI_NB_LANES];
+	size_t nb_blocks = CHECKSUM_MULTI_PASS_BLOCKS;
+
+	for (i = 0; i < CHECKSUM_MULTI_NB_LANES; i++) {
+		request = lanes[i];
+		if (request == NULL) {
+			for (j = 0; j < algorithm->nb_words; j++)
+				states[j][i] = 0;
+			data[i] = checksum_multi_idle_block;
+			continue;
+		}
+
+		for (j = 0; j < algorithm->nb_words; j++)
+			states[j][i] = request->stream->state[j];
+		data[i] = request->data;
+
+		if (request->nb_blocks < nb_blocks)
+			nb_blocks = request->nb_blocks;
+	}
+
+	size_t k;
+	for (k = 0; k < nb_blocks; k++) {
+		algorithm->kernel(states, data);
+
+		for (i = 0; i < CHECKSUM_MULTI_NB_LANES; i++)
+			if (lanes[i] != NULL)
+				data[i] += CHECKSUM_MULTI_BLOCK_SIZE;
+	}
+
+	for (i = 0; i < CHECKSUM_MULTI_NB_LANES; i++) {
+		request = lanes[i];
+		if (request == NULL)
+			continue;
+
+		for (j = 0; j < algorithm->nb_words; j++)
+			request->stream->state[j] = states[j][i];
+		request->data = data[i];
+		request->nb_blocks -= nb_blocks;
+	}
+}
+
+static void checksum_multi_run(struct checksum_multi_service * service, struct checksum_multi_request * request) {
+	const struct checksum_multi_algorithm * algorithm = service->algorithm;
+
+	pthread_once(&checksum_multi_once, checksum_multi_init);
+
+	pthread_mutex_lock(&service->lock);
+
+	// a batch would gather streams which have a cpu each onto one of them
+	bool in_place = service->nb_streams < checksum_multi_nb_cpus;
+	service->nb_streams++;
+
+	if (in_place) {
+		pthread_mutex_unlock(&service->lock);
+
+		for (; request->nb_blocks > 0; request->nb_blocks--, request->data += CHECKSUM_MULTI_BLOCK_SIZE)
+			algorithm->compress(request->stream->state, request->data);
+
+		pthread_mutex_lock(&service->lock);
+		service->nb_streams--;
+		pthread_mutex_unlock(&service->lock);
+		return;
+	}
+
+	if (service->last != NULL)
+		service->last->next = request;
+	else
+		service->first = request;
+	service->last = request;
+	request->queued = true;
+	service->nb_queued++;
+
+	while (!request->done) {
+		// a running combiner will take this request in its next pass
+		if (!request->queued || service->nb_queued <= service->nb_free_lanes) {
+			pthread_cond_wait(&service->wait, &service->lock);
+			continue;
+		}
+
+		checksum_multi_combine(service, request);
+	}
+
+	service->nb_streams--;
+
+	pthread_mutex_unlock(&service->lock);
+}
+
+static ssize_t checksum_multi_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_multi * self = checksum->data;
+	const struct checksum_multi_algorithm * algorithm = self->service->algorithm;
+	const uint8_t * ptr = data;
+	size_t left = length;
+
+	self->length += length;
+
+	if (self->index > 0) {
+		size_t nb_copy = CHECKSUM_MULTI_BLOCK_SIZE - self->index;
+		if (nb_copy > left)
+			nb_copy = left;
+
+		memcpy(self->block + self->index, ptr, nb_copy);
+		self->index += nb_copy;
+		ptr += nb_copy;
+		left -= nb_copy;
+
+		if (self->index < CHECKSUM_MULTI_BLOCK_SIZE)
+			return length;
+
+		algorithm->compress(self->state, self->block);
+		self->index = 0;
+	}
+
+	// whole blocks are hashed from the caller's buffer by the service
+	struct checksum_multi_request request = {
+		.stream    = self,
+		.data      = ptr,
+		.nb_blocks = left / CHECKSUM_MULTI_BLOCK_SIZE,
+		.queued    = false,
+		.done      = false,
+		.next      = NULL,
+	};
+
+	if (request.nb_blocks > 0) {
+		checksum_multi_run(self->service, &request);
+		ptr += (left / CHECKSUM_MULTI_BLOCK_SIZE) * CHECKSUM_MULTI_BLOCK_SIZE;
+		left %= CHECKSUM_MULTI_BLOCK_SIZE;
+	}
+
+	memcpy(self->block, ptr, left);
+	self->index = left;
+
+	return length;
+}
+
+#define CHECKSUM_SHA256_MULTI_ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+/**
+ * nettle has no public compression function for sha256, so lone streams
+ * use this one instead of relying on the layout of struct sha256_ctx
+ */
+static void checksum_sha256_multi_compress(uint32_t * state, const uint8_t * data) {
+	uint32_t w[64];
+	unsigned int i;
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 | (uint32_t) data[4 * i + 2] << 8 | data[4 * i + 3];
+
+	for (; i < 64; i++) {
+		uint32_t s0 = CHECKSUM_SHA256_MULTI_ROTR(w[i - 15], 7) ^ CHECKSUM_SHA256_MULTI_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = CHECKSUM_SHA256_MULTI_ROTR(w[i - 2], 17) ^ CHECKSUM_SHA256_MULTI_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		uint32_t s1 = CHECKSUM_SHA256_MULTI_ROTR(e, 6) ^ CHECKSUM_SHA256_MULTI_ROTR(e, 11) ^ CHECKSUM_SHA256_MULTI_ROTR(e, 25);
+		uint32_t ch = g ^ (e & (f ^ g));
+		uint32_t t1 = h + s1 + ch + checksum_sha256_multi_k[i] + w[i];
+
+		uint32_t s0 = CHECKSUM_SHA256_MULTI_ROTR(a, 2) ^ CHECKSUM_SHA256_MULTI_ROTR(a, 13) ^ CHECKSUM_SHA256_MULTI_ROTR(a, 22);
+		uint32_t maj = (a & b) | (c & (a | b));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + s0 + maj;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+static void checksum_sha256_multi_kernel(uint32_t (*states)[CHECKSUM_MULTI_NB_LANES], const uint8_t * const * data) {
+	uint32_t words[16][CHECKSUM_MULTI_NB_LANES] __attribute__((aligned(32)));
+	unsigned int i, lane;
+	for (i = 0; i < 16; i++)
+		for (lane = 0; lane < CHECKSUM_MULTI_NB_LANES; lane++) {
+			uint32_t word;
+			memcpy(&word, data[lane] + 4 * i, 4);
+			words[i][lane] = __builtin_bswap32(word);
+		}
+
+	__m256i w[16];
+	for (i = 0; i < 16; i++)
+		w[i] = _mm256_load_si256((const __m256i *) words[i]);
+
+	__m256i v[8], v0[8];
+	for (i = 0; i < 8; i++)
+		v[i] = v0[i] = _mm256_loadu_si256((const __m256i *) states[i]);
+
+	__m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+
+#pragma GCC unroll 64
+	for (i = 0; i < 64; i++) {
+		if (i >= 16) {
+			__m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+			__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(CHECKSUM_MULTI_ROTR(w15, 7), CHECKSUM_MULTI_ROTR(w15, 18)), _mm256_srli_epi32(w15, 3));
+			__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(CHECKSUM_MULTI_ROTR(w2, 17), CHECKSUM_MULTI_ROTR(w2, 19)), _mm256_srli_epi32(w2, 10));
+			w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+		}
+
+		__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(CHECKSUM_MULTI_ROTR(e, 6), CHECKSUM_MULTI_ROTR(e, 11)), CHECKSUM_MULTI_ROTR(e, 25));
+		__m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+		__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(checksum_sha256_multi_k[i]), w[i & 15])));
+
+		__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(CHECKSUM_MULTI_ROTR(a, 2), CHECKSUM_MULTI_ROTR(a, 13)), CHECKSUM_MULTI_ROTR(a, 22));
+		__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+		__m256i t2 = _mm256_add_epi32(s0, maj);
+
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+
+	v[0] = a, v[1] = b, v[2] = c, v[3] = d, v[4] = e, v[5] = f, v[6] = g, v[7] = h;
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *) states[i], _mm256_add_epi32(v[i], v0[i]));
+}
+
+struct checksum * checksum_sha256_multi_new_checksum() {
+	return checksum_multi_new(&checksum_sha256_multi_service);
+}
+
+#else
+
+#include "digest.h"
+
+bool checksum_has_avx2() {
+	return false;
+}
+
+struct checksum * checksum_sha256_multi_new_checksum() {
+	return NULL;
+}
+
+#endif
+
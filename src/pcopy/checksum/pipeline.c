@@ -0,0 +1,273 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+// pthread_cond_broadcast, pthread_cond_destroy, pthread_cond_init,
+// pthread_cond_signal, pthread_cond_wait, pthread_mutex_destroy,
+// pthread_mutex_init, pthread_mutex_lock, pthread_mutex_unlock
+#include <pthread.h>
+// free, malloc
+#include <stdlib.h>
+// memcpy
+#include <string.h>
+
+#include "../buffer.h"
+#include "../thread.h"
+#include "digest.h"
+
+/**
+ * A pipeline moves hashing to another thread of the pool, reads and writes
+ * stay on the thread of the caller. A buffer given to update_buffer() is
+ * queued into a bounded ring as it is and a free buffer of the ring is given
+ * back, so the caller can go on reading and writing while the previous
+ * buffers are hashed. Only data given to update() are copied.
+ */
+struct checksum_pipeline {
+	struct checksum * checksum;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wait_data;
+	pthread_cond_t wait_room;
+
+	struct checksum_pipeline_slot {
+		char * buffer;
+		ssize_t length;
+	} * slots;
+	unsigned int nb_slots;
+	unsigned int first;
+	unsigned int nb_used;
+
+	bool stop;
+	bool running;
+};
+
+static char * checksum_pipeline_digest(struct checksum * checksum);
+static void checksum_pipeline_free(struct checksum * checksum);
+static void checksum_pipeline_hash(void * arg);
+static void checksum_pipeline_release(struct checksum_pipeline * self);
+static ssize_t checksum_pipeline_update(struct checksum * checksum, const void * data, ssize_t length);
+static char * checksum_pipeline_update_buffer(struct checksum * checksum, char * buffer, ssize_t length);
+
+static struct checksum_ops checksum_pipeline_ops = {
+	.digest        = checksum_pipeline_digest,
+	.free          = checksum_pipeline_free,
+	.update        = checksum_pipeline_update,
+	.update_buffer = checksum_pipeline_update_buffer,
+};
+
+
+static char * checksum_pipeline_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_pipeline * self = checksum->data;
+
+	pthread_mutex_lock(&self->lock);
+	while (self->nb_used > 0)
+		pthread_cond_wait(&self->wait_room, &self->lock);
+	pthread_mutex_unlock(&self->lock);
+
+	return self->checksum->ops->digest(self->checksum);
+}
+
+static void checksum_pipeline_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	struct checksum_pipeline * self = checksum->data;
+
+	pthread_mutex_lock(&self->lock);
+	self->stop = true;
+	pthread_cond_signal(&self->wait_data);
+	while (self->running)
+		pthread_cond_wait(&self->wait_room, &self->lock);
+	pthread_mutex_unlock(&self->lock);
+
+	self->checksum->ops->free(self->checksum);
+
+	pthread_cond_destroy(&self->wait_room);
+	pthread_cond_destroy(&self->wait_data);
+	pthread_mutex_destroy(&self->lock);
+	checksum_pipeline_release(self);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+static void checksum_pipeline_hash(void * arg) {
+	struct checksum_pipeline * self = arg;
+
+	pthread_mutex_lock(&self->lock);
+
+	for (;;) {
+		while (self->nb_used == 0 && !self->stop)
+			pthread_cond_wait(&self->wait_data, &self->lock);
+
+		if (self->nb_used == 0)
+			break;
+
+		struct checksum_pipeline_slot * slot = self->slots + self->first;
+
+		pthread_mutex_unlock(&self->lock);
+
+		self->checksum->ops->update(self->checksum, slot->buffer, slot->length);
+
+		pthread_mutex_lock(&self->lock);
+
+		self->first = (self->first + 1) % self->nb_slots;
+		self->nb_used--;
+		pthread_cond_broadcast(&self->wait_room);
+	}
+
+	self->running = false;
+	pthread_cond_broadcast(&self->wait_room);
+
+	pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Returns NULL when the pipeline cannot be set up, <checksum> is then left
+ * as it is and can still be used synchronously
+ */
+struct checksum * checksum_pipeline_new(struct checksum * checksum, unsigned int nb_buffers) {
+	if (checksum == NULL || nb_buffers < 1)
+		return NULL;
+
+	struct checksum_pipeline * self = malloc(sizeof(struct checksum_pipeline));
+	if (self == NULL)
+		return NULL;
+
+	self->checksum = checksum;
+	self->slots = calloc(nb_buffers, sizeof(struct checksum_pipeline_slot));
+	if (self->slots == NULL) {
+		free(self);
+		return NULL;
+	}
+
+	self->nb_slots = nb_buffers;
+	self->first = self->nb_used = 0;
+	self->stop = false;
+	self->running = true;
+
+	unsigned int i;
+	for (i = 0; i < nb_buffers; i++) {
+		self->slots[i].buffer = buffer_get();
+		if (self->slots[i].buffer == NULL) {
+			checksum_pipeline_release(self);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->wait_data, NULL);
+	pthread_cond_init(&self->wait_room, NULL);
+
+	// allocated first, a hasher already running could not be stopped on failure
+	struct checksum * pipeline = malloc(sizeof(struct checksum));
+	if (pipeline == NULL || thread_pool_run("hasher", checksum_pipeline_hash, self) != 0) {
+		free(pipeline);
+		pthread_cond_destroy(&self->wait_room);
+		pthread_cond_destroy(&self->wait_data);
+		pthread_mutex_destroy(&self->lock);
+		checksum_pipeline_release(self);
+		return NULL;
+	}
+
+	pipeline->ops = &checksum_pipeline_ops;
+	pipeline->data = self;
+
+	return pipeline;
+}
+
+static void checksum_pipeline_release(struct checksum_pipeline * self) {
+	unsigned int i;
+	for (i = 0; i < self->nb_slots; i++)
+		buffer_release(self->slots[i].buffer);
+	free(self->slots);
+	free(self);
+}
+
+static ssize_t checksum_pipeline_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_pipeline * self = checksum->data;
+
+	const char * ptr = data;
+	ssize_t nb_left = length;
+	while (nb_left > 0) {
+		pthread_mutex_lock(&self->lock);
+		while (self->nb_used == self->nb_slots)
+			pthread_cond_wait(&self->wait_room, &self->lock);
+
+		struct checksum_pipeline_slot * slot = self->slots + (self->first + self->nb_used) % self->nb_slots;
+
+		pthread_mutex_unlock(&self->lock);
+
+		// slot is not visible to the hasher until it is counted as used
+		slot->length = nb_left < BUFFER_SIZE ? nb_left : BUFFER_SIZE;
+		memcpy(slot->buffer, ptr, slot->length);
+
+		ptr += slot->length;
+		nb_left -= slot->length;
+
+		pthread_mutex_lock(&self->lock);
+		self->nb_used++;
+		pthread_cond_signal(&self->wait_data);
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	return length;
+}
+
+static char * checksum_pipeline_update_buffer(struct checksum * checksum, char * buffer, ssize_t length) {
+	if (checksum == NULL || buffer == NULL || length < 1)
+		return buffer;
+
+	struct checksum_pipeline * self = checksum->data;
+
+	pthread_mutex_lock(&self->lock);
+	while (self->nb_used == self->nb_slots)
+		pthread_cond_wait(&self->wait_room, &self->lock);
+
+	// the free slot is hashed already, its buffer goes back to the caller
+	struct checksum_pipeline_slot * slot = self->slots + (self->first + self->nb_used) % self->nb_slots;
+	char * free_buffer = slot->buffer;
+	slot->buffer = buffer;
+	slot->length = length;
+
+	self->nb_used++;
+	pthread_cond_signal(&self->wait_data);
+	pthread_mutex_unlock(&self->lock);
+
+	return free_buffer;
+}
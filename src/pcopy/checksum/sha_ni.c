@@ -0,0 +1,347 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// __get_cpuid, __get_cpuid_count
+#include <cpuid.h>
+// _mm_*
+#include <immintrin.h>
+// uint8_t, uint32_t, uint64_t
+#include <stdint.h>
+// free, malloc
+#include <stdlib.h>
+// memcpy, memset, strdup
+#include <string.h>
+
+#include "digest.h"
+
+#define DIGEST_SHA_NI_BLOCK_SIZE 64
+#define DIGEST_SHA1_SIZE 20
+#define DIGEST_SHA256_SIZE 32
+
+/**
+ * SHA-1 and SHA-256 share the same padding, only the compression function
+ * and the size of the state differ
+ */
+struct checksum_sha_ni {
+	void (*compress)(uint32_t * state, const uint8_t * data, size_t nb_blocks);
+	unsigned int digest_size;
+
+	uint32_t state[8];
+	uint8_t block[DIGEST_SHA_NI_BLOCK_SIZE];
+	unsigned int index;
+	uint64_t length;
+
+	char digest[DIGEST_SHA256_SIZE * 2 + 1];
+};
+
+static void checksum_sha1_ni_compress(uint32_t * state, const uint8_t * data, size_t nb_blocks) __attribute__((target("sha,sse4.1")));
+static void checksum_sha256_ni_compress(uint32_t * state, const uint8_t * data, size_t nb_blocks) __attribute__((target("sha,sse4.1")));
+static char * checksum_sha_ni_digest(struct checksum * checksum);
+static void checksum_sha_ni_free(struct checksum * checksum);
+static struct checksum * checksum_sha_ni_new(void (*compress)(uint32_t * state, const uint8_t * data, size_t nb_blocks), const uint32_t * state, unsigned int digest_size);
+static ssize_t checksum_sha_ni_update(struct checksum * checksum, const void * data, ssize_t length);
+
+static struct checksum_ops checksum_sha_ni_ops = {
+	.digest = checksum_sha_ni_digest,
+	.free   = checksum_sha_ni_free,
+	.update = checksum_sha_ni_update,
+};
+
+static const uint32_t checksum_sha1_ni_init[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static const uint32_t checksum_sha256_ni_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t checksum_sha256_ni_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+bool checksum_has_sha_ni() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+		return false;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return (ebx & bit_SHA) != 0;
+}
+
+/**
+ * Each iteration of the loops below does four rounds, the message schedule
+ * is kept in four registers used as a ring
+ */
+static void checksum_sha1_ni_compress(uint32_t * state, const uint8_t * data, size_t nb_blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; nb_blocks > 0; nb_blocks--, data += DIGEST_SHA_NI_BLOCK_SIZE) {
+		const __m128i abcd_save = abcd, e0_save = e0;
+		__m128i msg[4], e[2] = { e0, e0 };
+
+		int i;
+#pragma GCC unroll 20
+		for (i = 0; i < 20; i++) {
+			__m128i * cur = msg + (i & 3);
+			if (i < 4)
+				*cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), mask);
+
+			if (i == 0)
+				e[0] = _mm_add_epi32(e[0], *cur);
+			else
+				e[i & 1] = _mm_sha1nexte_epu32(e[i & 1], *cur);
+			e[(i + 1) & 1] = abcd;
+
+			if (i >= 3 && i <= 18)
+				msg[(i + 1) & 3] = _mm_sha1msg2_epu32(msg[(i + 1) & 3], *cur);
+
+			switch (i / 5) {
+				case 0:
+					abcd = _mm_sha1rnds4_epu32(abcd, e[i & 1], 0);
+					break;
+				case 1:
+					abcd = _mm_sha1rnds4_epu32(abcd, e[i & 1], 1);
+					break;
+				case 2:
+					abcd = _mm_sha1rnds4_epu32(abcd, e[i & 1], 2);
+					break;
+				default:
+					abcd = _mm_sha1rnds4_epu32(abcd, e[i & 1], 3);
+					break;
+			}
+
+			if (i >= 1 && i <= 16)
+				msg[(i - 1) & 3] = _mm_sha1msg1_epu32(msg[(i - 1) & 3], *cur);
+			if (i >= 2 && i <= 17)
+				msg[(i - 2) & 3] = _mm_xor_si128(msg[(i - 2) & 3], *cur);
+		}
+
+		e0 = _mm_sha1nexte_epu32(e[0], e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static void checksum_sha256_ni_compress(uint32_t * state, const uint8_t * data, size_t nb_blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// the instructions work on ABEF and CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0xb1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)), 0x1b);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	for (; nb_blocks > 0; nb_blocks--, data += DIGEST_SHA_NI_BLOCK_SIZE) {
+		const __m128i abef_save = state0, cdgh_save = state1;
+		__m128i msg[4];
+
+		int i;
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			__m128i * cur = msg + (i & 3);
+			if (i < 4)
+				*cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), mask);
+
+			__m128i rounds = _mm_add_epi32(*cur, _mm_load_si128((const __m128i *) (checksum_sha256_ni_k + 4 * i)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+
+			if (i >= 3 && i <= 14) {
+				__m128i * next = msg + ((i + 1) & 3);
+				*next = _mm_add_epi32(*next, _mm_alignr_epi8(*cur, msg[(i - 1) & 3], 4));
+				*next = _mm_sha256msg2_epu32(*next, *cur);
+			}
+
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(rounds, 0x0e));
+
+			if (i >= 1 && i <= 12)
+				msg[(i - 1) & 3] = _mm_sha256msg1_epu32(msg[(i - 1) & 3], *cur);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *) state, _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static char * checksum_sha_ni_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_sha_ni * self = checksum->data;
+	if (self->digest[0] != '\0')
+		return strdup(self->digest);
+
+	// padding is done on copies so more data could still be added
+	uint32_t state[8];
+	memcpy(state, self->state, sizeof(state));
+
+	uint8_t block[2 * DIGEST_SHA_NI_BLOCK_SIZE];
+	memcpy(block, self->block, self->index);
+	block[self->index] = 0x80;
+
+	unsigned int nb_blocks = self->index < DIGEST_SHA_NI_BLOCK_SIZE - 8 ? 1 : 2;
+	unsigned int end = nb_blocks * DIGEST_SHA_NI_BLOCK_SIZE;
+	memset(block + self->index + 1, 0, end - self->index - 1);
+
+	uint64_t nb_bits = self->length * 8;
+	unsigned int i;
+	for (i = 0; i < 8; i++)
+		block[end - 1 - i] = nb_bits >> (8 * i);
+
+	self->compress(state, block, nb_blocks);
+
+	unsigned char digest[DIGEST_SHA256_SIZE];
+	for (i = 0; i < self->digest_size; i++)
+		digest[i] = state[i / 4] >> (24 - 8 * (i % 4));
+
+	digest_convert_to_hex(digest, self->digest_size, self->digest);
+
+	return strdup(self->digest);
+}
+
+static void checksum_sha_ni_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	free(checksum->data);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+static struct checksum * checksum_sha_ni_new(void (*compress)(uint32_t * state, const uint8_t * data, size_t nb_blocks), const uint32_t * state, unsigned int digest_size) {
+	struct checksum * checksum = malloc(sizeof(struct checksum));
+	checksum->ops = &checksum_sha_ni_ops;
+
+	struct checksum_sha_ni * self = malloc(sizeof(struct checksum_sha_ni));
+	self->compress = compress;
+	self->digest_size = digest_size;
+	memset(self->state, 0, sizeof(self->state));
+	memcpy(self->state, state, digest_size);
+	self->index = 0;
+	self->length = 0;
+	*self->digest = '\0';
+
+	checksum->data = self;
+	return checksum;
+}
+
+struct checksum * checksum_sha1_ni_new_checksum() {
+	return checksum_sha_ni_new(checksum_sha1_ni_compress, checksum_sha1_ni_init, DIGEST_SHA1_SIZE);
+}
+
+struct checksum * checksum_sha256_ni_new_checksum() {
+	return checksum_sha_ni_new(checksum_sha256_ni_compress, checksum_sha256_ni_init, DIGEST_SHA256_SIZE);
+}
+
+static ssize_t checksum_sha_ni_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_sha_ni * self = checksum->data;
+	const uint8_t * ptr = data;
+	size_t left = length;
+
+	self->length += length;
+
+	if (self->index > 0) {
+		size_t nb_copy = DIGEST_SHA_NI_BLOCK_SIZE - self->index;
+		if (nb_copy > left)
+			nb_copy = left;
+
+		memcpy(self->block + self->index, ptr, nb_copy);
+		self->index += nb_copy;
+		ptr += nb_copy;
+		left -= nb_copy;
+
+		if (self->index < DIGEST_SHA_NI_BLOCK_SIZE)
+			return length;
+
+		self->compress(self->state, self->block, 1);
+		self->index = 0;
+	}
+
+	// whole blocks are hashed from the caller's buffer
+	size_t nb_blocks = left / DIGEST_SHA_NI_BLOCK_SIZE;
+	if (nb_blocks > 0) {
+		self->compress(self->state, ptr, nb_blocks);
+		ptr += nb_blocks * DIGEST_SHA_NI_BLOCK_SIZE;
+		left -= nb_blocks * DIGEST_SHA_NI_BLOCK_SIZE;
+	}
+
+	memcpy(self->block, ptr, left);
+	self->index = left;
+
+	return length;
+}
+
+#else
+
+#include "digest.h"
+
+bool checksum_has_sha_ni() {
+	return false;
+}
+
+struct checksum * checksum_sha1_ni_new_checksum() {
+	return NULL;
+}
+
+struct checksum * checksum_sha256_ni_new_checksum() {
+	return NULL;
+}
+
+#endif
+
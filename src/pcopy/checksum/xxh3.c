@@ -0,0 +1,585 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+// _mm256_*
+#include <immintrin.h>
+#endif
+// pthread_once
+#include <pthread.h>
+// uint8_t, uint32_t, uint64_t
+#include <stdint.h>
+// free, malloc
+#include <stdlib.h>
+// memcpy, strdup
+#include <string.h>
+
+#include "digest.h"
+
+#define CHECKSUM_XXH3_STRIPE_SIZE 64
+#define CHECKSUM_XXH3_SECRET_SIZE 192
+#define CHECKSUM_XXH3_STRIPES_PER_BLOCK ((CHECKSUM_XXH3_SECRET_SIZE - CHECKSUM_XXH3_STRIPE_SIZE) / 8)
+#define CHECKSUM_XXH3_SHORT_SIZE 240
+
+#define CHECKSUM_XXH3_PRIME32_1 0x9E3779B1U
+#define CHECKSUM_XXH3_PRIME32_2 0x85EBCA77U
+#define CHECKSUM_XXH3_PRIME32_3 0xC2B2AE3DU
+#define CHECKSUM_XXH3_PRIME64_1 0x9E3779B185EBCA87ULL
+#define CHECKSUM_XXH3_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define CHECKSUM_XXH3_PRIME64_3 0x165667B19E3779F9ULL
+#define CHECKSUM_XXH3_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define CHECKSUM_XXH3_PRIME64_5 0x27D4EB2F165667C5ULL
+#define CHECKSUM_XXH3_PRIME_MX1 0x165667919E3779F9ULL
+#define CHECKSUM_XXH3_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+/**
+ * Long inputs are accumulated while they arrive, short ones are hashed as a
+ * whole by the digest, so the first bytes are kept aside.
+ * The last stripe is always hashed by the digest and may overlap the
+ * previous one, so at least one byte stays in the buffer.
+ */
+struct checksum_xxh3 {
+	bool is_128;
+
+	uint64_t acc[8];
+	unsigned int nb_stripes;
+
+	uint8_t buffer[CHECKSUM_XXH3_STRIPE_SIZE];
+	unsigned int nb_buffered;
+	uint8_t last_stripe[CHECKSUM_XXH3_STRIPE_SIZE];
+
+	uint8_t head[CHECKSUM_XXH3_SHORT_SIZE];
+	uint64_t length;
+
+	char digest[33];
+};
+
+struct checksum_xxh3_hash {
+	uint64_t low, high;
+};
+
+static void checksum_xxh3_accumulate(uint64_t * acc, const uint8_t * data, const uint8_t * secret, unsigned int nb_stripes);
+#if defined(__x86_64__) || defined(__i386__)
+static void checksum_xxh3_accumulate_avx2(uint64_t * acc, const uint8_t * data, const uint8_t * secret, unsigned int nb_stripes) __attribute__((target("avx2")));
+#endif
+static uint64_t checksum_xxh3_avalanche(uint64_t h);
+static void checksum_xxh3_consume(struct checksum_xxh3 * self, const uint8_t * data, size_t nb_stripes);
+static char * checksum_xxh3_digest(struct checksum * checksum);
+static void checksum_xxh3_free(struct checksum * checksum);
+static struct checksum_xxh3_hash checksum_xxh3_hash_128(const uint8_t * data, size_t length);
+static uint64_t checksum_xxh3_hash_64(const uint8_t * data, size_t length);
+static void checksum_xxh3_init(void);
+static struct checksum_xxh3_hash checksum_xxh3_long(struct checksum_xxh3 * self);
+static uint64_t checksum_xxh3_merge(const uint64_t * acc, const uint8_t * secret, uint64_t start);
+static struct checksum_xxh3_hash checksum_xxh3_mix32(struct checksum_xxh3_hash acc, const uint8_t * data1, const uint8_t * data2, const uint8_t * secret);
+static uint64_t checksum_xxh3_mix16(const uint8_t * data, const uint8_t * secret);
+static struct checksum_xxh3_hash checksum_xxh3_mul128(uint64_t a, uint64_t b);
+static uint64_t checksum_xxh3_mul128_fold64(uint64_t a, uint64_t b);
+static struct checksum * checksum_xxh3_new(bool is_128);
+static uint32_t checksum_xxh3_read32(const uint8_t * data);
+static uint64_t checksum_xxh3_read64(const uint8_t * data);
+static uint64_t checksum_xxh3_rrmxmx(uint64_t h, uint64_t length);
+static void checksum_xxh3_scramble(uint64_t * acc, const uint8_t * secret);
+#if defined(__x86_64__) || defined(__i386__)
+static void checksum_xxh3_scramble_avx2(uint64_t * acc, const uint8_t * secret) __attribute__((target("avx2")));
+#endif
+static ssize_t checksum_xxh3_update(struct checksum * checksum, const void * data, ssize_t length);
+static uint64_t checksum_xxh64_avalanche(uint64_t h);
+
+static struct checksum_ops checksum_xxh3_ops = {
+	.digest = checksum_xxh3_digest,
+	.free   = checksum_xxh3_free,
+	.update = checksum_xxh3_update,
+};
+
+static const uint8_t checksum_xxh3_secret[CHECKSUM_XXH3_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static pthread_once_t checksum_xxh3_once = PTHREAD_ONCE_INIT;
+static void (*checksum_xxh3_accumulate_stripes)(uint64_t * acc, const uint8_t * data, const uint8_t * secret, unsigned int nb_stripes) = checksum_xxh3_accumulate;
+static void (*checksum_xxh3_scramble_block)(uint64_t * acc, const uint8_t * secret) = checksum_xxh3_scramble;
+
+
+static void checksum_xxh3_accumulate(uint64_t * acc, const uint8_t * data, const uint8_t * secret, unsigned int nb_stripes) {
+	unsigned int i, j;
+	for (i = 0; i < nb_stripes; i++, data += CHECKSUM_XXH3_STRIPE_SIZE, secret += 8)
+		for (j = 0; j < 8; j++) {
+			uint64_t value = checksum_xxh3_read64(data + 8 * j);
+			uint64_t key = value ^ checksum_xxh3_read64(secret + 8 * j);
+			acc[j ^ 1] += value;
+			acc[j] += (key & 0xFFFFFFFF) * (key >> 32);
+		}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void checksum_xxh3_accumulate_avx2(uint64_t * acc, const uint8_t * data, const uint8_t * secret, unsigned int nb_stripes) {
+	__m256i acc0 = _mm256_loadu_si256((const __m256i *) acc);
+	__m256i acc1 = _mm256_loadu_si256((const __m256i *) (acc + 4));
+
+	unsigned int i;
+	for (i = 0; i < nb_stripes; i++, data += CHECKSUM_XXH3_STRIPE_SIZE, secret += 8) {
+		__m256i value0 = _mm256_loadu_si256((const __m256i *) data);
+		__m256i value1 = _mm256_loadu_si256((const __m256i *) (data + 32));
+		__m256i key0 = _mm256_xor_si256(value0, _mm256_loadu_si256((const __m256i *) secret));
+		__m256i key1 = _mm256_xor_si256(value1, _mm256_loadu_si256((const __m256i *) (secret + 32)));
+
+		// low half of each key times its high half, plus the neighbour's value
+		acc0 = _mm256_add_epi64(acc0, _mm256_mul_epu32(key0, _mm256_srli_epi64(key0, 32)));
+		acc1 = _mm256_add_epi64(acc1, _mm256_mul_epu32(key1, _mm256_srli_epi64(key1, 32)));
+		acc0 = _mm256_add_epi64(acc0, _mm256_shuffle_epi32(value0, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc1 = _mm256_add_epi64(acc1, _mm256_shuffle_epi32(value1, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+
+	_mm256_storeu_si256((__m256i *) acc, acc0);
+	_mm256_storeu_si256((__m256i *) (acc + 4), acc1);
+}
+#endif
+
+static uint64_t checksum_xxh3_avalanche(uint64_t h) {
+	h ^= h >> 37;
+	h *= CHECKSUM_XXH3_PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+static void checksum_xxh3_consume(struct checksum_xxh3 * self, const uint8_t * data, size_t nb_stripes) {
+	while (nb_stripes > 0) {
+		unsigned int nb_todo = CHECKSUM_XXH3_STRIPES_PER_BLOCK - self->nb_stripes;
+		if (nb_todo > nb_stripes)
+			nb_todo = nb_stripes;
+
+		checksum_xxh3_accumulate_stripes(self->acc, data, checksum_xxh3_secret + 8 * self->nb_stripes, nb_todo);
+		data += nb_todo * CHECKSUM_XXH3_STRIPE_SIZE;
+		nb_stripes -= nb_todo;
+
+		self->nb_stripes += nb_todo;
+		if (self->nb_stripes == CHECKSUM_XXH3_STRIPES_PER_BLOCK) {
+			checksum_xxh3_scramble_block(self->acc, checksum_xxh3_secret + CHECKSUM_XXH3_SECRET_SIZE - CHECKSUM_XXH3_STRIPE_SIZE);
+			self->nb_stripes = 0;
+		}
+	}
+}
+
+static char * checksum_xxh3_digest(struct checksum * checksum) {
+	if (checksum == NULL)
+		return NULL;
+
+	struct checksum_xxh3 * self = checksum->data;
+	if (self->digest[0] != '\0')
+		return strdup(self->digest);
+
+	struct checksum_xxh3_hash hash = { 0, 0 };
+	if (self->length > CHECKSUM_XXH3_SHORT_SIZE)
+		hash = checksum_xxh3_long(self);
+	else if (self->is_128)
+		hash = checksum_xxh3_hash_128(self->head, self->length);
+	else
+		hash.low = checksum_xxh3_hash_64(self->head, self->length);
+
+	// canonical form of xxhsum, most significant byte first
+	unsigned char digest[16];
+	unsigned int i, size = self->is_128 ? 16 : 8;
+	for (i = 0; i < 8; i++) {
+		digest[size - 1 - i] = hash.low >> (8 * i);
+		if (self->is_128)
+			digest[7 - i] = hash.high >> (8 * i);
+	}
+
+	digest_convert_to_hex(digest, size, self->digest);
+
+	return strdup(self->digest);
+}
+
+static void checksum_xxh3_free(struct checksum * checksum) {
+	if (checksum == NULL)
+		return;
+
+	free(checksum->data);
+
+	checksum->data = NULL;
+	checksum->ops = NULL;
+
+	free(checksum);
+}
+
+static struct checksum_xxh3_hash checksum_xxh3_hash_128(const uint8_t * data, size_t length) {
+	const uint8_t * secret = checksum_xxh3_secret;
+	struct checksum_xxh3_hash hash;
+
+	if (length == 0) {
+		hash.low = checksum_xxh64_avalanche(checksum_xxh3_read64(secret + 64) ^ checksum_xxh3_read64(secret + 72));
+		hash.high = checksum_xxh64_avalanche(checksum_xxh3_read64(secret + 80) ^ checksum_xxh3_read64(secret + 88));
+		return hash;
+	}
+
+	if (length <= 3) {
+		uint32_t combined_low = (uint32_t) data[0] << 16 | (uint32_t) data[length >> 1] << 24 | data[length - 1] | (uint32_t) length << 8;
+		uint32_t swapped = __builtin_bswap32(combined_low);
+		uint32_t combined_high = swapped << 13 | swapped >> 19;
+		uint64_t flip_low = checksum_xxh3_read32(secret) ^ checksum_xxh3_read32(secret + 4);
+		uint64_t flip_high = checksum_xxh3_read32(secret + 8) ^ checksum_xxh3_read32(secret + 12);
+		hash.low = checksum_xxh64_avalanche(combined_low ^ flip_low);
+		hash.high = checksum_xxh64_avalanche(combined_high ^ flip_high);
+		return hash;
+	}
+
+	if (length <= 8) {
+		uint64_t value = checksum_xxh3_read32(data) + ((uint64_t) checksum_xxh3_read32(data + length - 4) << 32);
+		uint64_t flip = checksum_xxh3_read64(secret + 16) ^ checksum_xxh3_read64(secret + 24);
+		hash = checksum_xxh3_mul128(value ^ flip, CHECKSUM_XXH3_PRIME64_1 + (length << 2));
+		hash.high += hash.low << 1;
+		hash.low ^= hash.high >> 3;
+		hash.low ^= hash.low >> 35;
+		hash.low *= CHECKSUM_XXH3_PRIME_MX2;
+		hash.low ^= hash.low >> 28;
+		hash.high = checksum_xxh3_avalanche(hash.high);
+		return hash;
+	}
+
+	if (length <= 16) {
+		uint64_t flip_low = checksum_xxh3_read64(secret + 32) ^ checksum_xxh3_read64(secret + 40);
+		uint64_t flip_high = checksum_xxh3_read64(secret + 48) ^ checksum_xxh3_read64(secret + 56);
+		uint64_t low = checksum_xxh3_read64(data);
+		uint64_t high = checksum_xxh3_read64(data + length - 8);
+
+		struct checksum_xxh3_hash m = checksum_xxh3_mul128(low ^ high ^ flip_low, CHECKSUM_XXH3_PRIME64_1);
+		m.low += (uint64_t) (length - 1) << 54;
+		high ^= flip_high;
+		m.high += high + (high & 0xFFFFFFFF) * (CHECKSUM_XXH3_PRIME32_2 - 1);
+		m.low ^= __builtin_bswap64(m.high);
+
+		hash = checksum_xxh3_mul128(m.low, CHECKSUM_XXH3_PRIME64_2);
+		hash.high += m.high * CHECKSUM_XXH3_PRIME64_2;
+		hash.low = checksum_xxh3_avalanche(hash.low);
+		hash.high = checksum_xxh3_avalanche(hash.high);
+		return hash;
+	}
+
+	struct checksum_xxh3_hash acc = { length * CHECKSUM_XXH3_PRIME64_1, 0 };
+
+	if (length <= 128) {
+		if (length > 32) {
+			if (length > 64) {
+				if (length > 96)
+					acc = checksum_xxh3_mix32(acc, data + 48, data + length - 64, secret + 96);
+				acc = checksum_xxh3_mix32(acc, data + 32, data + length - 48, secret + 64);
+			}
+			acc = checksum_xxh3_mix32(acc, data + 16, data + length - 32, secret + 32);
+		}
+		acc = checksum_xxh3_mix32(acc, data, data + length - 16, secret);
+	} else {
+		unsigned int i, nb_rounds = length / 32;
+		for (i = 0; i < 4; i++)
+			acc = checksum_xxh3_mix32(acc, data + 32 * i, data + 32 * i + 16, secret + 32 * i);
+		acc.low = checksum_xxh3_avalanche(acc.low);
+		acc.high = checksum_xxh3_avalanche(acc.high);
+
+		for (i = 4; i < nb_rounds; i++)
+			acc = checksum_xxh3_mix32(acc, data + 32 * i, data + 32 * i + 16, secret + 3 + 32 * (i - 4));
+		acc = checksum_xxh3_mix32(acc, data + length - 16, data + length - 32, secret + 136 - 17 - 16);
+	}
+
+	hash.low = checksum_xxh3_avalanche(acc.low + acc.high);
+	hash.high = 0 - checksum_xxh3_avalanche(acc.low * CHECKSUM_XXH3_PRIME64_1 + acc.high * CHECKSUM_XXH3_PRIME64_4 + length * CHECKSUM_XXH3_PRIME64_2);
+	return hash;
+}
+
+static uint64_t checksum_xxh3_hash_64(const uint8_t * data, size_t length) {
+	const uint8_t * secret = checksum_xxh3_secret;
+
+	if (length == 0)
+		return checksum_xxh64_avalanche(checksum_xxh3_read64(secret + 56) ^ checksum_xxh3_read64(secret + 64));
+
+	if (length <= 3) {
+		uint32_t combined = (uint32_t) data[0] << 16 | (uint32_t) data[length >> 1] << 24 | data[length - 1] | (uint32_t) length << 8;
+		uint64_t flip = checksum_xxh3_read32(secret) ^ checksum_xxh3_read32(secret + 4);
+		return checksum_xxh64_avalanche(combined ^ flip);
+	}
+
+	if (length <= 8) {
+		uint64_t value = checksum_xxh3_read32(data + length - 4) + ((uint64_t) checksum_xxh3_read32(data) << 32);
+		uint64_t flip = checksum_xxh3_read64(secret + 8) ^ checksum_xxh3_read64(secret + 16);
+		return checksum_xxh3_rrmxmx(value ^ flip, length);
+	}
+
+	if (length <= 16) {
+		uint64_t low = checksum_xxh3_read64(data) ^ (checksum_xxh3_read64(secret + 24) ^ checksum_xxh3_read64(secret + 32));
+		uint64_t high = checksum_xxh3_read64(data + length - 8) ^ (checksum_xxh3_read64(secret + 40) ^ checksum_xxh3_read64(secret + 48));
+		return checksum_xxh3_avalanche(length + __builtin_bswap64(low) + high + checksum_xxh3_mul128_fold64(low, high));
+	}
+
+	uint64_t acc = length * CHECKSUM_XXH3_PRIME64_1;
+
+	if (length <= 128) {
+		if (length > 32) {
+			if (length > 64) {
+				if (length > 96) {
+					acc += checksum_xxh3_mix16(data + 48, secret + 96);
+					acc += checksum_xxh3_mix16(data + length - 64, secret + 112);
+				}
+				acc += checksum_xxh3_mix16(data + 32, secret + 64);
+				acc += checksum_xxh3_mix16(data + length - 48, secret + 80);
+			}
+			acc += checksum_xxh3_mix16(data + 16, secret + 32);
+			acc += checksum_xxh3_mix16(data + length - 32, secret + 48);
+		}
+		acc += checksum_xxh3_mix16(data, secret);
+		acc += checksum_xxh3_mix16(data + length - 16, secret + 16);
+		return checksum_xxh3_avalanche(acc);
+	}
+
+	unsigned int i, nb_rounds = length / 16;
+	for (i = 0; i < 8; i++)
+		acc += checksum_xxh3_mix16(data + 16 * i, secret + 16 * i);
+	acc = checksum_xxh3_avalanche(acc);
+
+	for (i = 8; i < nb_rounds; i++)
+		acc += checksum_xxh3_mix16(data + 16 * i, secret + 16 * (i - 8) + 3);
+	acc += checksum_xxh3_mix16(data + length - 16, secret + 136 - 17);
+
+	return checksum_xxh3_avalanche(acc);
+}
+
+static void checksum_xxh3_init() {
+#if defined(__x86_64__) || defined(__i386__)
+	if (checksum_has_avx2()) {
+		checksum_xxh3_accumulate_stripes = checksum_xxh3_accumulate_avx2;
+		checksum_xxh3_scramble_block = checksum_xxh3_scramble_avx2;
+	}
+#endif
+}
+
+static struct checksum_xxh3_hash checksum_xxh3_long(struct checksum_xxh3 * self) {
+	uint64_t acc[8];
+	memcpy(acc, self->acc, sizeof(acc));
+
+	// last stripe ends with the buffered bytes
+	uint8_t stripe[CHECKSUM_XXH3_STRIPE_SIZE];
+	unsigned int nb_previous = CHECKSUM_XXH3_STRIPE_SIZE - self->nb_buffered;
+	memcpy(stripe, self->last_stripe + self->nb_buffered, nb_previous);
+	memcpy(stripe + nb_previous, self->buffer, self->nb_buffered);
+
+	checksum_xxh3_accumulate_stripes(acc, stripe, checksum_xxh3_secret + CHECKSUM_XXH3_SECRET_SIZE - CHECKSUM_XXH3_STRIPE_SIZE - 7, 1);
+
+	struct checksum_xxh3_hash hash;
+	hash.low = checksum_xxh3_merge(acc, checksum_xxh3_secret + 11, self->length * CHECKSUM_XXH3_PRIME64_1);
+	if (self->is_128)
+		hash.high = checksum_xxh3_merge(acc, checksum_xxh3_secret + CHECKSUM_XXH3_SECRET_SIZE - 64 - 11, ~(self->length * CHECKSUM_XXH3_PRIME64_2));
+	return hash;
+}
+
+static uint64_t checksum_xxh3_merge(const uint64_t * acc, const uint8_t * secret, uint64_t start) {
+	unsigned int i;
+	for (i = 0; i < 4; i++)
+		start += checksum_xxh3_mul128_fold64(acc[2 * i] ^ checksum_xxh3_read64(secret + 16 * i), acc[2 * i + 1] ^ checksum_xxh3_read64(secret + 16 * i + 8));
+	return checksum_xxh3_avalanche(start);
+}
+
+static struct checksum_xxh3_hash checksum_xxh3_mix32(struct checksum_xxh3_hash acc, const uint8_t * data1, const uint8_t * data2, const uint8_t * secret) {
+	acc.low += checksum_xxh3_mix16(data1, secret);
+	acc.low ^= checksum_xxh3_read64(data2) + checksum_xxh3_read64(data2 + 8);
+	acc.high += checksum_xxh3_mix16(data2, secret + 16);
+	acc.high ^= checksum_xxh3_read64(data1) + checksum_xxh3_read64(data1 + 8);
+	return acc;
+}
+
+static uint64_t checksum_xxh3_mix16(const uint8_t * data, const uint8_t * secret) {
+	return checksum_xxh3_mul128_fold64(checksum_xxh3_read64(data) ^ checksum_xxh3_read64(secret), checksum_xxh3_read64(data + 8) ^ checksum_xxh3_read64(secret + 8));
+}
+
+static struct checksum_xxh3_hash checksum_xxh3_mul128(uint64_t a, uint64_t b) {
+	unsigned __int128 product = (unsigned __int128) a * b;
+	struct checksum_xxh3_hash result = { (uint64_t) product, (uint64_t) (product >> 64) };
+	return result;
+}
+
+static uint64_t checksum_xxh3_mul128_fold64(uint64_t a, uint64_t b) {
+	struct checksum_xxh3_hash product = checksum_xxh3_mul128(a, b);
+	return product.low ^ product.high;
+}
+
+static struct checksum * checksum_xxh3_new(bool is_128) {
+	pthread_once(&checksum_xxh3_once, checksum_xxh3_init);
+
+	struct checksum * checksum = malloc(sizeof(struct checksum));
+	checksum->ops = &checksum_xxh3_ops;
+
+	struct checksum_xxh3 * self = malloc(sizeof(struct checksum_xxh3));
+	self->is_128 = is_128;
+
+	static const uint64_t acc[8] = {
+		CHECKSUM_XXH3_PRIME32_3, CHECKSUM_XXH3_PRIME64_1, CHECKSUM_XXH3_PRIME64_2, CHECKSUM_XXH3_PRIME64_3,
+		CHECKSUM_XXH3_PRIME64_4, CHECKSUM_XXH3_PRIME32_2, CHECKSUM_XXH3_PRIME64_5, CHECKSUM_XXH3_PRIME32_1,
+	};
+	memcpy(self->acc, acc, sizeof(acc));
+	self->nb_stripes = 0;
+	self->nb_buffered = 0;
+	self->length = 0;
+	*self->digest = '\0';
+
+	checksum->data = self;
+	return checksum;
+}
+
+struct checksum * checksum_xxh128_new_checksum() {
+	return checksum_xxh3_new(true);
+}
+
+struct checksum * checksum_xxh3_new_checksum() {
+	return checksum_xxh3_new(false);
+}
+
+static uint32_t checksum_xxh3_read32(const uint8_t * data) {
+	uint32_t value;
+	memcpy(&value, data, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+static uint64_t checksum_xxh3_read64(const uint8_t * data) {
+	uint64_t value;
+	memcpy(&value, data, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	return value;
+}
+
+static uint64_t checksum_xxh3_rrmxmx(uint64_t h, uint64_t length) {
+	h ^= (h << 49 | h >> 15) ^ (h << 24 | h >> 40);
+	h *= CHECKSUM_XXH3_PRIME_MX2;
+	h ^= (h >> 35) + length;
+	h *= CHECKSUM_XXH3_PRIME_MX2;
+	h ^= h >> 28;
+	return h;
+}
+
+static void checksum_xxh3_scramble(uint64_t * acc, const uint8_t * secret) {
+	unsigned int i;
+	for (i = 0; i < 8; i++) {
+		uint64_t value = acc[i];
+		value ^= value >> 47;
+		value ^= checksum_xxh3_read64(secret + 8 * i);
+		acc[i] = value * CHECKSUM_XXH3_PRIME32_1;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void checksum_xxh3_scramble_avx2(uint64_t * acc, const uint8_t * secret) {
+	const __m256i prime = _mm256_set1_epi32(CHECKSUM_XXH3_PRIME32_1);
+
+	unsigned int i;
+	for (i = 0; i < 8; i += 4) {
+		__m256i value = _mm256_loadu_si256((const __m256i *) (acc + i));
+		value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 47));
+		value = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i *) (secret + 8 * i)));
+
+		// 64 bits times 32 bits from two 32 bits multiplications
+		__m256i low = _mm256_mul_epu32(value, prime);
+		__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+		_mm256_storeu_si256((__m256i *) (acc + i), _mm256_add_epi64(low, _mm256_slli_epi64(high, 32)));
+	}
+}
+#endif
+
+static ssize_t checksum_xxh3_update(struct checksum * checksum, const void * data, ssize_t length) {
+	if (checksum == NULL || data == NULL || length < 1)
+		return -1;
+
+	struct checksum_xxh3 * self = checksum->data;
+	const uint8_t * ptr = data;
+	size_t left = length;
+
+	if (self->length < CHECKSUM_XXH3_SHORT_SIZE) {
+		size_t nb_copy = CHECKSUM_XXH3_SHORT_SIZE - self->length;
+		if (nb_copy > left)
+			nb_copy = left;
+		memcpy(self->head + self->length, ptr, nb_copy);
+	}
+	self->length += length;
+
+	if (self->nb_buffered > 0) {
+		size_t nb_copy = CHECKSUM_XXH3_STRIPE_SIZE - self->nb_buffered;
+		if (nb_copy > left)
+			nb_copy = left;
+
+		memcpy(self->buffer + self->nb_buffered, ptr, nb_copy);
+		self->nb_buffered += nb_copy;
+		ptr += nb_copy;
+		left -= nb_copy;
+
+		// a full buffer is only hashed once more data shows it is not the last stripe
+		if (left == 0)
+			return length;
+
+		checksum_xxh3_consume(self, self->buffer, 1);
+		memcpy(self->last_stripe, self->buffer, CHECKSUM_XXH3_STRIPE_SIZE);
+		self->nb_buffered = 0;
+	}
+
+	if (left > CHECKSUM_XXH3_STRIPE_SIZE) {
+		size_t nb_stripes = (left - 1) / CHECKSUM_XXH3_STRIPE_SIZE;
+		checksum_xxh3_consume(self, ptr, nb_stripes);
+
+		ptr += nb_stripes * CHECKSUM_XXH3_STRIPE_SIZE;
+		left -= nb_stripes * CHECKSUM_XXH3_STRIPE_SIZE;
+		memcpy(self->last_stripe, ptr - CHECKSUM_XXH3_STRIPE_SIZE, CHECKSUM_XXH3_STRIPE_SIZE);
+	}
+
+	memcpy(self->buffer, ptr, left);
+	self->nb_buffered = left;
+
+	return length;
+}
+
+static uint64_t checksum_xxh64_avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= CHECKSUM_XXH3_PRIME64_2;
+	h ^= h >> 29;
+	h *= CHECKSUM_XXH3_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
@@ -0,0 +1,561 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#define _GNU_SOURCE
+// errno
+#include <errno.h>
+// fallocate, posix_fadvise, sync_file_range
+#include <fcntl.h>
+// gettext
+#include <libintl.h>
+// FICLONERANGE, file_clone_range
+#include <linux/fs.h>
+// fstat
+#include <sys/stat.h>
+// memset, strcmp
+#include <string.h>
+// ioctl
+#include <sys/ioctl.h>
+// copy_file_range, ftruncate, lseek, pread, pwrite
+#include <unistd.h>
+
+#include "buffer.h"
+#include "checksum.h"
+#include "copy.h"
+#include "copy/engine.h"
+#include "log.h"
+#include "option.h"
+#include "util.h"
+#include "worker.h"
+
+#define COPY_KERNEL_WINDOW 1048576
+
+static enum copy_status copy_copy_file_range(struct copy_file * file);
+static enum copy_status copy_read_write(struct copy_file * file);
+static bool copy_preallocate(struct copy_file * file);
+static enum copy_status copy_reflink(struct copy_file * file);
+static bool copy_run(struct copy_engine * engine, struct copy_file * file, bool preallocate);
+static bool copy_sparse(struct copy_file * file);
+static bool copy_write(struct copy_file * file, const char * buffer, ssize_t length, off_t position);
+
+static struct copy_engine copy_engines_list[] = {
+	{ "reflink",         copy_reflink },
+	{ "copy_file_range", copy_copy_file_range },
+	{ "io_uring",        copy_uring },
+	{ "read_write",      copy_read_write },
+
+	{ NULL, NULL },
+};
+
+static struct copy_engine * copy_default_engine = copy_engines_list;
+
+
+static enum copy_status copy_copy_file_range(struct copy_file * file) {
+	struct worker * worker = file->worker;
+
+	/*
+	 * copy_file_range goes through the page cache, that's what O_DIRECT
+	 * tries to avoid, and it cannot skip zero blocks
+	 */
+	if (file->direct || file->skip_zero)
+		return copy_status_unsupported;
+
+	char * buffer = buffer_get();
+	if (buffer == NULL)
+		return copy_status_unsupported;
+
+	enum copy_status status = copy_status_done;
+	off_t offset = file->offset, end = file->offset + file->size;
+	while (offset < end) {
+		size_t length = end - offset;
+		if (length > COPY_KERNEL_WINDOW)
+			length = COPY_KERNEL_WINDOW;
+
+		loff_t off_in = offset, off_out = offset;
+		ssize_t nb_copied = copy_file_range(file->fd_in, &off_in, file->fd_out, &off_out, length, 0);
+
+		if (nb_copied < 0) {
+			/*
+			 * Nothing has been written yet so the next engine can take over
+			 * from the beginning of the range
+			 */
+			if (offset == file->offset && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL || errno == EBADF))
+				status = copy_status_unsupported;
+			else {
+				log_write(gettext("#%lu ! error fatal, error while copying from '%s' to '%s' because %m"), worker->job, worker->src_file, worker->dest_file);
+				status = copy_status_error;
+			}
+			break;
+		}
+
+		if (nb_copied == 0)
+			break;
+
+		copy_write_behind(file, offset + nb_copied);
+
+		// data has just been copied by the kernel, so reading it back hits the page cache
+		if (!copy_hash_range(file, offset, offset + nb_copied, &buffer)) {
+			status = copy_status_error;
+			break;
+		}
+
+		offset += nb_copied;
+	}
+
+	buffer_release(buffer);
+
+	return status;
+}
+
+bool copy_data(struct copy_file * file) {
+	const struct pcopy_option * option = file->worker->option;
+
+	file->skip_zero = option->sparse == pcopy_sparse_always;
+
+	bool sparse = file->skip_zero;
+	if (option->sparse == pcopy_sparse_auto) {
+		// a source file with fewer blocks than its size has holes
+		struct stat info;
+		sparse = fstat(file->fd_in, &info) == 0 && info.st_blocks * 512 < info.st_size;
+	}
+
+	bool ok;
+	if (sparse)
+		ok = copy_sparse(file);
+	else
+		ok = copy_run(copy_default_engine, file, option->preallocate);
+
+	if (!ok || !file->holes)
+		return ok;
+
+	// when the range ends with a hole, nothing has extended the destination
+	struct stat info;
+	off_t end = file->offset + file->size;
+	if (fstat(file->fd_out, &info) == 0 && info.st_size >= end)
+		return true;
+
+	if (ftruncate(file->fd_out, end) != 0) {
+		log_write(gettext("#%lu ! error fatal, failed to truncate '%s' because %m"), file->worker->job, file->worker->dest_file);
+		return false;
+	}
+
+	return true;
+}
+
+struct copy_engine * copy_engines() {
+	return copy_engines_list;
+}
+
+struct copy_engine * copy_get_default() {
+	return copy_default_engine;
+}
+
+bool copy_hash_range(struct copy_file * file, off_t begin, off_t end, char ** buffer) {
+	struct worker * worker = file->worker;
+
+	// another job is in charge of the digest of this range
+	if (file->checksum == NULL) {
+		copy_progress(file, end);
+		return true;
+	}
+
+	while (begin < end) {
+		size_t length = end - begin;
+		if (file->direct)
+			length = buffer_align(length);
+		if (length > BUFFER_SIZE)
+			length = BUFFER_SIZE;
+
+		ssize_t nb_read = pread(file->fd_in, *buffer, length, begin);
+		if (nb_read < 0) {
+			log_write(gettext("#%lu ! error fatal, error while reading from '%s' because %m"), worker->job, worker->src_file);
+			return false;
+		}
+
+		if (nb_read == 0)
+			break;
+
+		if (nb_read > end - begin)
+			nb_read = end - begin;
+
+		*buffer = checksum_update_buffer(file->checksum, *buffer, nb_read);
+
+		begin += nb_read;
+		copy_progress(file, begin);
+
+		util_check_load_average(worker, worker->option->load_average);
+	}
+
+	return true;
+}
+
+void copy_progress(struct copy_file * file, off_t done) {
+	if (file->size < 1)
+		return;
+
+	float pct = done - file->offset;
+	file->worker->pct = file->pct_base + file->ratio * pct / file->size;
+
+	// an engine falling back to the next one may start again from the beginning
+	if (done - file->offset > file->progress) {
+		file->worker->nb_bytes += done - file->offset - file->progress;
+		file->progress = done - file->offset;
+	}
+}
+
+static bool copy_preallocate(struct copy_file * file) {
+	if (file->size < 1)
+		return true;
+
+	/*
+	 * Allocate the whole range at once so the destination is not fragmented
+	 * by concurrent jobs. Size is kept so a failed copy does not leave a
+	 * file which looks complete.
+	 */
+	if (fallocate(file->fd_out, FALLOC_FL_KEEP_SIZE, file->offset, file->size) == 0)
+		return true;
+
+	if (errno == ENOSPC || errno == EDQUOT) {
+		log_write(gettext("#%lu ! error fatal, failed to allocate %lld bytes for '%s' because %m"), file->worker->job, (long long) file->size, file->worker->dest_file);
+		return false;
+	}
+
+	// filesystem does not support it, blocks will be allocated while writing
+	return true;
+}
+
+static enum copy_status copy_read_write(struct copy_file * file) {
+	struct worker * worker = file->worker;
+
+	char * buffer = buffer_get();
+	if (buffer == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to copy '%s'"), worker->job, worker->src_file);
+		return copy_status_error;
+	}
+
+	enum copy_status status = copy_status_done;
+	ssize_t nb_read = 0;
+	off_t position = file->offset, end = file->offset + file->size;
+	bool padded = false;
+	while (position < end) {
+		ssize_t length = end - position;
+		if (length > BUFFER_SIZE)
+			length = BUFFER_SIZE;
+
+		/*
+		 * With O_DIRECT, every write except the last one should be
+		 * aligned so the buffer is filled as much as possible
+		 */
+		nb_read = 0;
+		while (nb_read < length) {
+			size_t nb_wanted = length - nb_read;
+			if (file->direct)
+				nb_wanted = buffer_align(nb_wanted);
+
+			ssize_t nb_part = pread(file->fd_in, buffer + nb_read, nb_wanted, position + nb_read);
+			if (nb_part <= 0) {
+				if (nb_part < 0)
+					nb_read = -1;
+				break;
+			}
+
+			nb_read += nb_part;
+
+			if (!file->direct)
+				break;
+		}
+
+		if (nb_read <= 0)
+			break;
+
+		if (nb_read > length)
+			nb_read = length;
+
+		length = nb_read;
+		if (file->direct && length % BUFFER_ALIGNMENT != 0) {
+			// the tail of the file is padded then truncated
+			length = buffer_align(length);
+			memset(buffer + nb_read, 0, length - nb_read);
+			padded = true;
+		}
+
+		if (!copy_write(file, buffer, length, position)) {
+			status = copy_status_error;
+			break;
+		}
+
+		position += nb_read;
+		copy_progress(file, position);
+		copy_write_behind(file, position);
+
+		if (file->checksum != NULL)
+			buffer = checksum_update_buffer(file->checksum, buffer, nb_read);
+
+		util_check_load_average(worker, worker->option->load_average);
+	}
+
+	if (nb_read < 0) {
+		log_write(gettext("#%lu ! error fatal, error while reading from '%s' because %m"), worker->job, worker->src_file);
+		status = copy_status_error;
+	}
+
+	if (status == copy_status_done && padded && ftruncate(file->fd_out, position) != 0) {
+		log_write(gettext("#%lu ! error fatal, failed to truncate '%s' because %m"), worker->job, worker->dest_file);
+		status = copy_status_error;
+	}
+
+	buffer_release(buffer);
+
+	return status;
+}
+
+static enum copy_status copy_reflink(struct copy_file * file) {
+#ifdef FICLONERANGE
+	struct file_clone_range range = {
+		.src_fd      = file->fd_in,
+		.src_offset  = file->offset,
+		.src_length  = file->size,
+		.dest_offset = file->offset,
+	};
+
+	if (ioctl(file->fd_out, FICLONERANGE, &range) != 0)
+		return copy_status_unsupported;
+
+	log_write(gettext("#%lu @ '%s' shares its data with '%s'"), file->worker->job, file->worker->dest_file, file->worker->src_file);
+
+	char * buffer = buffer_get();
+	if (buffer == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), file->worker->job, file->worker->src_file);
+		return copy_status_error;
+	}
+
+	bool ok = copy_hash_range(file, file->offset, file->offset + file->size, &buffer);
+	buffer_release(buffer);
+
+	return ok ? copy_status_done : copy_status_error;
+#else
+	return copy_status_unsupported;
+#endif
+}
+
+static bool copy_run(struct copy_engine * engine, struct copy_file * file, bool preallocate) {
+	for (; engine->name != NULL; engine++) {
+		// a clone does not need any block, so allocate them only when it fails
+		if (preallocate && engine->copy != copy_reflink) {
+			preallocate = false;
+			if (!copy_preallocate(file))
+				return false;
+		}
+
+		enum copy_status status = engine->copy(file);
+		if (status != copy_status_unsupported)
+			return status == copy_status_done;
+	}
+
+	return false;
+}
+
+bool copy_set_default(const char * engine) {
+	if (engine == NULL)
+		return false;
+
+	struct copy_engine * ptr = copy_engines_list;
+	for (; ptr->name != NULL; ptr++)
+		if (strcmp(engine, ptr->name) == 0) {
+			copy_default_engine = ptr;
+			return true;
+		}
+
+	return false;
+}
+
+static bool copy_sparse(struct copy_file * file) {
+	struct worker * worker = file->worker;
+
+	// a clone shares extents, so holes are kept as they are
+	struct copy_engine * engine = copy_default_engine;
+	if (engine->copy == copy_reflink) {
+		enum copy_status status = copy_reflink(file);
+		if (status != copy_status_unsupported)
+			return status == copy_status_done;
+
+		engine++;
+	}
+
+	char * zero = NULL;
+	off_t position = file->offset, end = file->offset + file->size;
+	bool ok = true;
+
+	while (ok && position < end) {
+		/*
+		 * ENXIO means there is no more data until the end of file,
+		 * other errors mean that holes cannot be found so the
+		 * remaining part is copied as data
+		 */
+		off_t data = lseek(file->fd_in, position, SEEK_DATA);
+		if (data < 0)
+			data = errno == ENXIO ? end : position;
+		if (data > end)
+			data = end;
+
+		if (position < data) {
+			file->holes = true;
+
+			// the digest covers the logical content of the file, holes included
+			if (file->checksum != NULL && zero == NULL) {
+				zero = buffer_get();
+				if (zero == NULL) {
+					log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), worker->job, worker->src_file);
+					ok = false;
+					break;
+				}
+				memset(zero, 0, BUFFER_SIZE);
+			}
+
+			while (position < data) {
+				ssize_t length = data - position;
+				if (length > BUFFER_SIZE)
+					length = BUFFER_SIZE;
+
+				if (file->checksum != NULL)
+					file->checksum->ops->update(file->checksum, zero, length);
+
+				position += length;
+			}
+
+			copy_progress(file, position);
+		}
+
+		if (position >= end)
+			break;
+
+		off_t hole = lseek(file->fd_in, position, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+
+		struct copy_file part = *file;
+		part.offset = position;
+		part.size = hole - position;
+		part.pct_base = file->pct_base + file->ratio * (position - file->offset) / file->size;
+		part.ratio = file->ratio * part.size / file->size;
+		part.progress = 0;
+
+		ok = copy_run(engine, &part, false);
+
+		file->holes |= part.holes;
+		if (position + part.progress - file->offset > file->progress)
+			file->progress = position + part.progress - file->offset;
+		file->write_started = part.write_started;
+		file->write_dropped = part.write_dropped;
+
+		position = hole;
+	}
+
+	buffer_release(zero);
+
+	return ok;
+}
+
+static bool copy_write(struct copy_file * file, const char * buffer, ssize_t length, off_t position) {
+	struct worker * worker = file->worker;
+
+	ssize_t offset = 0;
+	while (offset < length) {
+		ssize_t run = length - offset;
+
+		if (file->skip_zero) {
+			// look for a run of blocks which are all zero or all not
+			bool zero = util_is_zero(buffer + offset, run < BUFFER_ALIGNMENT ? run : BUFFER_ALIGNMENT);
+
+			run = 0;
+			while (offset + run < length) {
+				ssize_t block = length - offset - run;
+				if (block > BUFFER_ALIGNMENT)
+					block = BUFFER_ALIGNMENT;
+
+				if (util_is_zero(buffer + offset + run, block) != zero)
+					break;
+
+				run += block;
+			}
+
+			if (zero) {
+				file->holes = true;
+				offset += run;
+				continue;
+			}
+		}
+
+		ssize_t nb_total_write = 0;
+		while (nb_total_write < run) {
+			ssize_t nb_write = pwrite(file->fd_out, buffer + offset + nb_total_write, run - nb_total_write, position + offset + nb_total_write);
+			if (nb_write < 0) {
+				log_write(gettext("#%lu ! error fatal, error while writing to '%s' because %m"), worker->job, worker->dest_file);
+				return false;
+			}
+
+			nb_total_write += nb_write;
+		}
+
+		offset += run;
+	}
+
+	return true;
+}
+
+void copy_write_behind(struct copy_file * file, off_t written) {
+	off_t window = file->worker->option->write_behind;
+	if (window < 1 || file->direct)
+		return;
+
+	if (file->write_started < file->offset)
+		file->write_started = file->write_dropped = file->offset;
+
+	if (written - file->write_started < window)
+		return;
+
+	/*
+	 * Start writeback of the last window without waiting for it, then wait
+	 * for the windows started before and drop them from page cache. So each
+	 * job keeps at most two windows of dirty or under-writeback pages.
+	 */
+	sync_file_range(file->fd_out, file->write_started, written - file->write_started, SYNC_FILE_RANGE_WRITE);
+
+	if (file->write_dropped < file->write_started) {
+		off_t length = file->write_started - file->write_dropped;
+		sync_file_range(file->fd_out, file->write_dropped, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(file->fd_out, file->write_dropped, length, POSIX_FADV_DONTNEED);
+		file->write_dropped = file->write_started;
+	}
+
+	file->write_started = written;
+}
+
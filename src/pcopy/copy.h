@@ -0,0 +1,86 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#ifndef __PCOPY_COPY_H__
+#define __PCOPY_COPY_H__
+
+// bool
+#include <stdbool.h>
+// off_t
+#include <sys/types.h>
+
+struct checksum;
+struct worker;
+
+struct copy_file {
+	struct worker * worker;
+
+	int fd_in;
+	int fd_out;
+	off_t offset;
+	off_t size;
+	bool direct;
+
+	struct checksum * checksum;
+	float pct_base;
+	float ratio;
+
+	// all-zero blocks are not written, which leaves holes
+	bool skip_zero;
+	bool holes;
+
+	// write-behind state, see --write-behind
+	off_t write_started;
+	off_t write_dropped;
+
+	// bytes from offset already added to the worker's counter
+	off_t progress;
+};
+
+enum copy_status {
+	copy_status_done,
+	copy_status_error,
+	copy_status_unsupported,
+};
+
+struct copy_engine {
+	char * name;
+	enum copy_status (*copy)(struct copy_file * file);
+};
+
+bool copy_data(struct copy_file * file);
+struct copy_engine * copy_engines(void);
+struct copy_engine * copy_get_default(void);
+bool copy_hash_range(struct copy_file * file, off_t begin, off_t end, char ** buffer);
+bool copy_set_default(const char * engine);
+
+#endif
+
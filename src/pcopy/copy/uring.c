@@ -0,0 +1,465 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#define _GNU_SOURCE
+// errno
+#include <errno.h>
+// gettext
+#include <libintl.h>
+// io_uring_params, io_uring_sqe, io_uring_cqe
+#include <linux/io_uring.h>
+// pthread_getspecific, pthread_key_create, pthread_once, pthread_setspecific
+#include <pthread.h>
+// calloc, free, posix_memalign
+#include <stdlib.h>
+// memset
+#include <string.h>
+// mmap, munmap
+#include <sys/mman.h>
+// SYS_io_uring_enter, SYS_io_uring_setup
+#include <sys/syscall.h>
+// close, ftruncate, syscall
+#include <unistd.h>
+
+#include "../buffer.h"
+#include "../checksum.h"
+#include "../log.h"
+#include "../option.h"
+#include "../util.h"
+#include "../worker.h"
+#include "engine.h"
+
+#define COPY_URING_BLOCK_SIZE 131072
+
+struct copy_uring_ring {
+	int fd;
+	unsigned int depth;
+
+	void * sq_ptr;
+	size_t sq_size;
+	unsigned int * sq_tail;
+	unsigned int * sq_mask;
+	unsigned int * sq_array;
+	unsigned int nb_to_submit;
+
+	void * cq_ptr;
+	size_t cq_size;
+	unsigned int * cq_head;
+	unsigned int * cq_tail;
+	unsigned int * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	struct io_uring_sqe * sqes;
+	size_t sqes_size;
+
+	struct copy_uring_slot {
+		char * buffer;
+		off_t offset;
+		size_t length;
+		size_t write_length;
+		size_t done;
+
+		enum {
+			copy_uring_slot_free,
+			copy_uring_slot_reading,
+			copy_uring_slot_writing,
+			copy_uring_slot_written,
+		} state;
+		bool hashed;
+	} * slots;
+};
+
+static pthread_key_t copy_uring_key;
+static pthread_once_t copy_uring_once = PTHREAD_ONCE_INIT;
+
+static void copy_uring_free(void * arg);
+static struct copy_uring_ring * copy_uring_get(unsigned int depth);
+static void copy_uring_init(void);
+static void copy_uring_prepare(struct copy_uring_ring * ring, int opcode, int fd, unsigned int i_slot, size_t length);
+static int copy_uring_submit(struct copy_uring_ring * ring, unsigned int min_complete);
+
+
+static void copy_uring_free(void * arg) {
+	struct copy_uring_ring * ring = arg;
+	if (ring == NULL)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < ring->depth; i++)
+		free(ring->slots[i].buffer);
+	free(ring->slots);
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+
+	free(ring);
+}
+
+/**
+ * Rings are kept by each thread of the pool, so setting up io_uring is only
+ * paid once per thread and not once per file.
+ */
+static struct copy_uring_ring * copy_uring_get(unsigned int depth) {
+	pthread_once(&copy_uring_once, copy_uring_init);
+
+	struct copy_uring_ring * ring = pthread_getspecific(copy_uring_key);
+	if (ring != NULL && ring->depth == depth)
+		return ring;
+
+	copy_uring_free(ring);
+	pthread_setspecific(copy_uring_key, NULL);
+
+#ifdef SYS_io_uring_setup
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = syscall(SYS_io_uring_setup, depth, &params);
+	if (fd < 0)
+		return NULL;
+#else
+	return NULL;
+#endif
+
+	ring = calloc(1, sizeof(struct copy_uring_ring));
+	if (ring == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	ring->fd = fd;
+	ring->depth = depth;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		close(fd);
+		free(ring);
+		return NULL;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(fd);
+			free(ring);
+			return NULL;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ptr != ring->sq_ptr)
+			munmap(ring->cq_ptr, ring->cq_size);
+		munmap(ring->sq_ptr, ring->sq_size);
+		close(fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_tail = ring->sq_ptr + params.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + params.sq_off.array;
+
+	ring->cq_head = ring->cq_ptr + params.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + params.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + params.cq_off.cqes;
+
+	ring->slots = calloc(depth, sizeof(struct copy_uring_slot));
+	if (ring->slots == NULL) {
+		ring->depth = 0;
+		copy_uring_free(ring);
+		return NULL;
+	}
+
+	unsigned int i;
+	for (i = 0; i < depth; i++)
+		if (posix_memalign((void **) &ring->slots[i].buffer, BUFFER_ALIGNMENT, COPY_URING_BLOCK_SIZE) != 0) {
+			ring->depth = i;
+			copy_uring_free(ring);
+			return NULL;
+		}
+
+	pthread_setspecific(copy_uring_key, ring);
+
+	return ring;
+}
+
+static void copy_uring_init() {
+	pthread_key_create(&copy_uring_key, copy_uring_free);
+}
+
+static void copy_uring_prepare(struct copy_uring_ring * ring, int opcode, int fd, unsigned int i_slot, size_t length) {
+	struct copy_uring_slot * slot = ring->slots + i_slot;
+
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+
+	struct io_uring_sqe * sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) (slot->buffer + slot->done);
+	sqe->len = length - slot->done;
+	sqe->off = slot->offset + slot->done;
+	sqe->user_data = i_slot;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->nb_to_submit++;
+}
+
+static int copy_uring_submit(struct copy_uring_ring * ring, unsigned int min_complete) {
+	for (;;) {
+		int ret = syscall(SYS_io_uring_enter, ring->fd, ring->nb_to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0) {
+			ring->nb_to_submit -= ret;
+			return 0;
+		}
+
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+enum copy_status copy_uring(struct copy_file * file) {
+	struct worker * worker = file->worker;
+
+	unsigned int depth = worker->option->queue_depth;
+	if (depth < 1)
+		return copy_status_unsupported;
+
+	struct copy_uring_ring * ring = copy_uring_get(depth);
+	if (ring == NULL)
+		return copy_status_unsupported;
+
+	unsigned int i;
+	for (i = 0; i < depth; i++) {
+		ring->slots[i].state = copy_uring_slot_free;
+		ring->slots[i].hashed = false;
+	}
+
+	off_t next_read = file->offset, hashed = file->offset, end = file->offset + file->size;
+	unsigned int nb_inflight = 0;
+	bool failed = false, padded = false, unsupported = false, written = false;
+
+	while (!failed && (hashed < end || nb_inflight > 0)) {
+		for (i = 0; i < depth && next_read < end; i++) {
+			struct copy_uring_slot * slot = ring->slots + i;
+			if (slot->state != copy_uring_slot_free)
+				continue;
+
+			slot->offset = next_read;
+			slot->length = end - next_read;
+			if (slot->length > COPY_URING_BLOCK_SIZE)
+				slot->length = COPY_URING_BLOCK_SIZE;
+			slot->done = 0;
+			slot->state = copy_uring_slot_reading;
+			slot->hashed = false;
+
+			copy_uring_prepare(ring, IORING_OP_READ, file->fd_in, i, file->direct ? buffer_align(slot->length) : slot->length);
+			next_read += slot->length;
+			nb_inflight++;
+		}
+
+		if (nb_inflight == 0)
+			break;
+
+		if (copy_uring_submit(ring, 1) != 0) {
+			log_write(gettext("#%lu ! error fatal, failed to submit requests to io_uring because %m"), worker->job);
+			failed = true;
+			break;
+		}
+
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe * cqe = ring->cqes + (head & *ring->cq_mask);
+			struct copy_uring_slot * slot = ring->slots + cqe->user_data;
+			int res = cqe->res;
+
+			nb_inflight--;
+
+			if (slot->state == copy_uring_slot_reading) {
+				if (res < 0) {
+					errno = -res;
+					if (!written && hashed == file->offset && (res == -EINVAL || res == -EOPNOTSUPP))
+						unsupported = true;
+					else
+						log_write(gettext("#%lu ! error fatal, error while reading from '%s' because %m"), worker->job, worker->src_file);
+					failed = true;
+					continue;
+				}
+
+				if (res == 0) {
+					// source file has been truncated while copying it
+					slot->length = slot->done;
+					end = slot->offset + slot->length;
+					next_read = end;
+				} else {
+					slot->done += res;
+
+					// O_DIRECT reads are rounded up to the alignment
+					if (slot->done > slot->length)
+						slot->done = slot->length;
+				}
+
+				if (slot->done < slot->length) {
+					copy_uring_prepare(ring, IORING_OP_READ, file->fd_in, cqe->user_data, slot->length);
+					nb_inflight++;
+					continue;
+				}
+
+				slot->done = 0;
+				slot->write_length = slot->length;
+				slot->state = copy_uring_slot_writing;
+
+				if (file->direct && slot->length % BUFFER_ALIGNMENT != 0) {
+					// the tail of the file is padded then truncated
+					slot->write_length = buffer_align(slot->length);
+					memset(slot->buffer + slot->length, 0, slot->write_length - slot->length);
+					padded = true;
+				}
+
+				if (slot->length > 0 && file->skip_zero && util_is_zero(slot->buffer, slot->write_length)) {
+					// whole block is zero, leave a hole instead of writing it
+					slot->state = copy_uring_slot_written;
+					file->holes = true;
+				} else if (slot->length > 0) {
+					copy_uring_prepare(ring, IORING_OP_WRITE, file->fd_out, cqe->user_data, slot->write_length);
+					nb_inflight++;
+					written = true;
+				} else
+					slot->state = copy_uring_slot_written;
+			} else if (slot->state == copy_uring_slot_writing) {
+				if (res < 0) {
+					errno = -res;
+					log_write(gettext("#%lu ! error fatal, error while writing to '%s' because %m"), worker->job, worker->dest_file);
+					failed = true;
+					continue;
+				}
+
+				slot->done += res;
+				if (slot->done < slot->write_length) {
+					copy_uring_prepare(ring, IORING_OP_WRITE, file->fd_out, cqe->user_data, slot->write_length);
+					nb_inflight++;
+				} else
+					slot->state = copy_uring_slot_written;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		// digest has to be computed in file order, whatever the order of completions
+		bool found;
+		do {
+			found = false;
+			for (i = 0; i < depth; i++) {
+				struct copy_uring_slot * slot = ring->slots + i;
+				if (slot->hashed || slot->offset != hashed || (slot->state != copy_uring_slot_writing && slot->state != copy_uring_slot_written))
+					continue;
+
+				if (slot->length > 0 && file->checksum != NULL)
+					file->checksum->ops->update(file->checksum, slot->buffer, slot->length);
+
+				slot->hashed = true;
+				hashed += slot->length;
+				found = slot->length > 0;
+			}
+		} while (found && hashed < end);
+
+		copy_progress(file, hashed);
+
+		// write-behind needs the end of data whose writes are all completed
+		off_t written_end = next_read;
+		for (i = 0; i < depth; i++) {
+			struct copy_uring_slot * slot = ring->slots + i;
+			if ((slot->state == copy_uring_slot_reading || slot->state == copy_uring_slot_writing) && slot->offset < written_end)
+				written_end = slot->offset;
+		}
+		copy_write_behind(file, written_end);
+
+		for (i = 0; i < depth; i++) {
+			struct copy_uring_slot * slot = ring->slots + i;
+			if (slot->state == copy_uring_slot_written && slot->hashed)
+				slot->state = copy_uring_slot_free;
+		}
+
+		util_check_load_average(worker, worker->option->load_average);
+	}
+
+	// buffers cannot be reused while the kernel still owns some of them
+	while (nb_inflight > 0) {
+		if (copy_uring_submit(ring, 1) != 0)
+			break;
+
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		nb_inflight -= tail - head;
+		__atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+	}
+
+	/**
+	 * The kernel may still write into some buffers, so the ring is dropped
+	 * and its buffers are left to it instead of being given to the next file.
+	 */
+	if (nb_inflight > 0) {
+		log_write(gettext("#%lu ! warning, %u requests to io_uring are still running, drop the ring"), worker->job, nb_inflight);
+		ring->depth = 0;
+		copy_uring_free(ring);
+		pthread_setspecific(copy_uring_key, NULL);
+	}
+
+	if (unsupported)
+		return copy_status_unsupported;
+
+	if (!failed && padded && ftruncate(file->fd_out, end) != 0) {
+		log_write(gettext("#%lu ! error fatal, failed to truncate '%s' because %m"), worker->job, worker->dest_file);
+		failed = true;
+	}
+
+	return failed ? copy_status_error : copy_status_done;
+}
+
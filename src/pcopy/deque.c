@@ -0,0 +1,144 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+// pthread_mutex_destroy, pthread_mutex_init, pthread_mutex_lock,
+// pthread_mutex_unlock
+#include <pthread.h>
+// free, malloc, realloc
+#include <stdlib.h>
+// memcpy
+#include <string.h>
+
+#include "deque.h"
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+struct deque {
+	pthread_mutex_t lock;
+
+	void ** items;
+	unsigned int first;
+	unsigned int nb_items;
+	unsigned int capacity;
+};
+
+
+void deque_free(struct deque * deque) {
+	if (deque == NULL)
+		return;
+
+	pthread_mutex_destroy(&deque->lock);
+	free(deque->items);
+	free(deque);
+}
+
+struct deque * deque_new() {
+	struct deque * deque = malloc(sizeof(struct deque));
+	if (deque == NULL)
+		return NULL;
+
+	deque->items = malloc(DEQUE_INITIAL_CAPACITY * sizeof(void *));
+	if (deque->items == NULL) {
+		free(deque);
+		return NULL;
+	}
+
+	pthread_mutex_init(&deque->lock, NULL);
+	deque->first = deque->nb_items = 0;
+	deque->capacity = DEQUE_INITIAL_CAPACITY;
+
+	return deque;
+}
+
+void * deque_pop(struct deque * deque) {
+	void * item = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->nb_items > 0) {
+		deque->nb_items--;
+		item = deque->items[(deque->first + deque->nb_items) % deque->capacity];
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return item;
+}
+
+bool deque_push(struct deque * deque, void * item) {
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->nb_items == deque->capacity) {
+		void ** items = realloc(deque->items, 2 * deque->capacity * sizeof(void *));
+		if (items == NULL) {
+			pthread_mutex_unlock(&deque->lock);
+			return false;
+		}
+
+		// unwrap the ring so items stay contiguous from first
+		memcpy(items + deque->capacity, items, deque->first * sizeof(void *));
+
+		deque->items = items;
+		deque->capacity *= 2;
+	}
+
+	deque->items[(deque->first + deque->nb_items) % deque->capacity] = item;
+	deque->nb_items++;
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return true;
+}
+
+unsigned int deque_size(struct deque * deque) {
+	pthread_mutex_lock(&deque->lock);
+	unsigned int nb_items = deque->nb_items;
+	pthread_mutex_unlock(&deque->lock);
+
+	return nb_items;
+}
+
+void * deque_steal(struct deque * deque) {
+	void * item = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->nb_items > 0) {
+		item = deque->items[deque->first];
+		deque->first = (deque->first + 1) % deque->capacity;
+		deque->nb_items--;
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return item;
+}
+
@@ -0,0 +1,54 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#ifndef __PCOPY_DEQUE_H__
+#define __PCOPY_DEQUE_H__
+
+// bool
+#include <stdbool.h>
+
+/**
+ * Double-ended queue used for work stealing: the owner pushes and pops at
+ * the bottom (LIFO, the most recent work is still hot in cache) while other
+ * threads steal from the top (FIFO, the oldest and usually biggest work).
+ * Each deque has its own lock so owners never contend on a global one.
+ */
+struct deque;
+
+void deque_free(struct deque * deque);
+struct deque * deque_new(void);
+void * deque_pop(struct deque * deque);
+bool deque_push(struct deque * deque, void * item);
+unsigned int deque_size(struct deque * deque);
+void * deque_steal(struct deque * deque);
+
+#endif
+
@@ -0,0 +1,359 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#define _GNU_SOURCE
+// sync_file_range
+#include <fcntl.h>
+// gettext
+#include <libintl.h>
+// pthread_cond_broadcast, pthread_cond_wait, pthread_mutex_lock,
+// pthread_mutex_unlock
+#include <pthread.h>
+// calloc, free, malloc, realloc
+#include <stdlib.h>
+// strdup
+#include <string.h>
+// fstat
+#include <sys/stat.h>
+// dev_t
+#include <sys/types.h>
+// close, dup, fsync, syncfs
+#include <unistd.h>
+
+#include "flush.h"
+#include "log.h"
+#include "option.h"
+#include "thread.h"
+
+// each batch keeps descriptors of its files open until it is flushed
+#define FLUSH_MAX_RUNNING 4
+
+struct flush_file {
+	unsigned long job;
+	int fd;
+	char * filename;
+};
+
+struct flush_batch {
+	struct flush_file * files;
+	unsigned int nb_files;
+};
+
+/**
+ * With 'fs' policy, one descriptor is kept per destination filesystem and
+ * every file written on it becomes durable with a single syncfs()
+ */
+struct flush_filesystem {
+	dev_t device;
+	int fd;
+	char * filename;
+	unsigned long nb_files;
+};
+
+static const struct pcopy_option * flush_option = NULL;
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wait = PTHREAD_COND_INITIALIZER;
+
+static struct flush_batch * flush_current = NULL;
+static unsigned int flush_nb_running = 0;
+
+static struct flush_filesystem * flush_filesystems = NULL;
+static unsigned int flush_nb_filesystems = 0;
+
+static unsigned long flush_nb_written = 0;
+static unsigned long flush_nb_durable = 0;
+// files which are known to be not durable
+static unsigned long flush_nb_failed = 0;
+
+static bool flush_add_batch(unsigned long job, int fd, const char * filename);
+static bool flush_add_filesystem(unsigned long job, int fd, const char * filename);
+static void flush_batch_do(void * arg);
+static bool flush_now(unsigned long job, int fd, const char * filename);
+
+
+bool flush_add(unsigned long job, int fd, const char * filename) {
+	pthread_mutex_lock(&flush_lock);
+	flush_nb_written++;
+	pthread_mutex_unlock(&flush_lock);
+
+	switch (flush_option->sync) {
+		case pcopy_sync_batch:
+			return flush_add_batch(job, fd, filename);
+
+		case pcopy_sync_filesystem:
+			return flush_add_filesystem(job, fd, filename);
+
+		default:
+			return flush_now(job, fd, filename);
+	}
+}
+
+static bool flush_add_batch(unsigned long job, int fd, const char * filename) {
+	int new_fd = dup(fd);
+	if (new_fd < 0) {
+		log_write(gettext("#%lu ! warning, failed to queue '%s' for flushing because %m"), job, filename);
+		return flush_now(job, fd, filename);
+	}
+
+	char * new_filename = strdup(filename);
+	if (new_filename == NULL) {
+		close(new_fd);
+
+		log_write(gettext("#%lu ! warning, not enough memory to queue '%s' for flushing"), job, filename);
+		return flush_now(job, fd, filename);
+	}
+
+	pthread_mutex_lock(&flush_lock);
+
+	if (flush_current == NULL) {
+		flush_current = malloc(sizeof(struct flush_batch));
+		if (flush_current != NULL) {
+			flush_current->files = calloc(flush_option->sync_batch, sizeof(struct flush_file));
+			flush_current->nb_files = 0;
+
+			if (flush_current->files == NULL) {
+				free(flush_current);
+				flush_current = NULL;
+			}
+		}
+
+		if (flush_current == NULL) {
+			pthread_mutex_unlock(&flush_lock);
+			close(new_fd);
+			free(new_filename);
+
+			log_write(gettext("#%lu ! warning, not enough memory to queue '%s' for flushing"), job, filename);
+			return flush_now(job, fd, filename);
+		}
+	}
+
+	// start writeback now, so the fsync of the batch mostly waits for the journal
+	sync_file_range(new_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+	struct flush_file * file = flush_current->files + flush_current->nb_files++;
+	file->job = job;
+	file->fd = new_fd;
+	file->filename = new_filename;
+
+	struct flush_batch * batch = NULL;
+	if (flush_current->nb_files == flush_option->sync_batch) {
+		batch = flush_current;
+		flush_current = NULL;
+
+		// the job waits for a flusher, so threads and descriptors stay bounded
+		while (flush_nb_running >= FLUSH_MAX_RUNNING)
+			pthread_cond_wait(&flush_wait, &flush_lock);
+		flush_nb_running++;
+	}
+
+	pthread_mutex_unlock(&flush_lock);
+
+	log_write(gettext("#%lu > file '%s' is queued for flushing"), job, filename);
+
+	if (batch != NULL && thread_pool_run("flusher", flush_batch_do, batch) != 0)
+		flush_batch_do(batch);
+
+	return true;
+}
+
+static bool flush_add_filesystem(unsigned long job, int fd, const char * filename) {
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		log_write(gettext("#%lu ! warning, failed to get information of '%s' because %m"), job, filename);
+		return flush_now(job, fd, filename);
+	}
+
+	pthread_mutex_lock(&flush_lock);
+
+	struct flush_filesystem * fs = NULL;
+	unsigned int i;
+	for (i = 0; i < flush_nb_filesystems && fs == NULL; i++)
+		if (flush_filesystems[i].device == info.st_dev)
+			fs = flush_filesystems + i;
+
+	if (fs == NULL) {
+		void * new_addr = realloc(flush_filesystems, (flush_nb_filesystems + 1) * sizeof(struct flush_filesystem));
+		char * new_filename = new_addr != NULL ? strdup(filename) : NULL;
+		int new_fd = new_filename != NULL ? dup(fd) : -1;
+
+		if (new_fd < 0) {
+			if (new_addr != NULL)
+				flush_filesystems = new_addr;
+			pthread_mutex_unlock(&flush_lock);
+			free(new_filename);
+
+			log_write(gettext("#%lu ! warning, failed to track filesystem of '%s'"), job, filename);
+			return flush_now(job, fd, filename);
+		}
+
+		flush_filesystems = new_addr;
+		fs = flush_filesystems + flush_nb_filesystems++;
+		fs->device = info.st_dev;
+		fs->fd = new_fd;
+		fs->filename = new_filename;
+		fs->nb_files = 0;
+	}
+
+	fs->nb_files++;
+
+	pthread_mutex_unlock(&flush_lock);
+
+	log_write(gettext("#%lu > file '%s' is written, it will be durable once its filesystem is synced"), job, filename);
+
+	return true;
+}
+
+static void flush_batch_do(void * arg) {
+	struct flush_batch * batch = arg;
+
+	unsigned int i;
+	for (i = 0; i < batch->nb_files; i++) {
+		struct flush_file * file = batch->files + i;
+
+		bool durable = fsync(file->fd) == 0;
+		if (durable)
+			log_write(gettext("#%lu > file '%s' is durable"), file->job, file->filename);
+		else
+			log_write(gettext("#%lu ! error while flushing file from '%s' because %m"), file->job, file->filename);
+
+		// the job is already done, so the failure is only counted
+		pthread_mutex_lock(&flush_lock);
+		if (durable)
+			flush_nb_durable++;
+		else
+			flush_nb_failed++;
+		pthread_mutex_unlock(&flush_lock);
+
+		close(file->fd);
+		free(file->filename);
+	}
+
+	free(batch->files);
+	free(batch);
+
+	pthread_mutex_lock(&flush_lock);
+	flush_nb_running--;
+	pthread_cond_broadcast(&flush_wait);
+	pthread_mutex_unlock(&flush_lock);
+}
+
+void flush_finish() {
+	pthread_mutex_lock(&flush_lock);
+
+	struct flush_batch * batch = flush_current;
+	flush_current = NULL;
+	if (batch != NULL)
+		flush_nb_running++;
+
+	pthread_mutex_unlock(&flush_lock);
+
+	if (batch != NULL)
+		flush_batch_do(batch);
+
+	pthread_mutex_lock(&flush_lock);
+
+	while (flush_nb_running > 0)
+		pthread_cond_wait(&flush_wait, &flush_lock);
+
+	struct flush_filesystem * filesystems = flush_filesystems;
+	unsigned int nb_filesystems = flush_nb_filesystems;
+	flush_filesystems = NULL;
+	flush_nb_filesystems = 0;
+
+	pthread_mutex_unlock(&flush_lock);
+
+	unsigned int i;
+	for (i = 0; i < nb_filesystems; i++) {
+		struct flush_filesystem * fs = filesystems + i;
+
+		log_write(gettext("> syncing filesystem of '%s'"), fs->filename);
+
+		if (syncfs(fs->fd) == 0) {
+			log_write(gettext("> filesystem of '%s' is synced, %lu files are durable"), fs->filename, fs->nb_files);
+
+			pthread_mutex_lock(&flush_lock);
+			flush_nb_durable += fs->nb_files;
+			pthread_mutex_unlock(&flush_lock);
+		} else {
+			log_write(gettext("! error while syncing filesystem of '%s' because %m, %lu files may not be durable"), fs->filename, fs->nb_files);
+
+			pthread_mutex_lock(&flush_lock);
+			flush_nb_failed += fs->nb_files;
+			pthread_mutex_unlock(&flush_lock);
+		}
+
+		close(fs->fd);
+		free(fs->filename);
+	}
+
+	free(filesystems);
+
+	pthread_mutex_lock(&flush_lock);
+	unsigned long nb_failed = flush_nb_failed;
+	pthread_mutex_unlock(&flush_lock);
+
+	if (nb_failed > 0)
+		log_write(gettext("! error, %lu files failed to be flushed and may not be durable"), nb_failed);
+}
+
+void flush_get_stats(unsigned long * nb_written, unsigned long * nb_durable, unsigned long * nb_failed) {
+	pthread_mutex_lock(&flush_lock);
+	*nb_written = flush_nb_written;
+	*nb_durable = flush_nb_durable;
+	*nb_failed = flush_nb_failed;
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static bool flush_now(unsigned long job, int fd, const char * filename) {
+	log_write(gettext("#%lu > flushing file '%s'"), job, filename);
+
+	if (fsync(fd) != 0) {
+		log_write(gettext("#%lu ! error while flushing file from '%s' because %m"), job, filename);
+
+		pthread_mutex_lock(&flush_lock);
+		flush_nb_failed++;
+		pthread_mutex_unlock(&flush_lock);
+
+		return false;
+	}
+
+	pthread_mutex_lock(&flush_lock);
+	flush_nb_durable++;
+	pthread_mutex_unlock(&flush_lock);
+
+	return true;
+}
+
+void flush_setup(const struct pcopy_option * option) {
+	flush_option = option;
+}
+
@@ -0,0 +1,55 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#ifndef __PCOPY_FLUSH_H__
+#define __PCOPY_FLUSH_H__
+
+// bool
+#include <stdbool.h>
+
+struct pcopy_option;
+
+/**
+ * Make data written into fd durable according to --sync policy.
+ * fd is still owned by the caller. Returns false only if the file is known
+ * to be not durable (i.e. fsync failed with 'file' policy). Later failures
+ * of 'batch' and 'fs' policies are counted by flush_get_stats().
+ */
+bool flush_add(unsigned long job, int fd, const char * filename);
+/**
+ * Wait for pending batches and sync each destination filesystem
+ */
+void flush_finish(void);
+void flush_get_stats(unsigned long * nb_written, unsigned long * nb_durable, unsigned long * nb_failed);
+void flush_setup(const struct pcopy_option * option);
+
+#endif
+
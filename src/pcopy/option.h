@@ -32,9 +32,56 @@
 #ifndef __PCOPY_OPTION_H__
 #define __PCOPY_OPTION_H__
 
+// bool
+#include <stdbool.h>
+// off_t
+#include <sys/types.h>
+
+enum pcopy_verify {
+	pcopy_verify_cached,
+	pcopy_verify_drop_cache,
+	pcopy_verify_direct,
+};
+
+enum pcopy_sync {
+	pcopy_sync_file,
+	pcopy_sync_batch,
+	pcopy_sync_filesystem,
+};
+
+enum pcopy_sparse {
+	pcopy_sparse_never,
+	pcopy_sparse_auto,
+	pcopy_sparse_always,
+};
+
+enum pcopy_sort {
+	pcopy_sort_none,
+	pcopy_sort_name,
+	pcopy_sort_inode,
+};
+
 struct pcopy_option {
 	unsigned int nb_jobs;
 	double load_average;
+	unsigned int queue_depth;
+	bool direct_io;
+	off_t split_size;
+	unsigned int pipeline_depth;
+	enum pcopy_verify verify;
+	off_t verify_readahead;
+	enum pcopy_sync sync;
+	unsigned int sync_batch;
+	off_t write_behind;
+	enum pcopy_sparse sparse;
+	bool preallocate;
+	unsigned int nb_walkers;
+	enum pcopy_sort sort;
+	off_t small_size;
+	unsigned int nb_small_jobs;
+	unsigned int group_files;
+	unsigned int nb_device_jobs;
+	double adaptive;
 };
 
 #endif
@@ -38,6 +38,8 @@
 // curs_set, halfdelay, has_colors, keypad, initscr, init_pair,
 // newwin, noecho, nonl, start_color
 #include <ncurses.h>
+// pthread_mutex_lock, pthread_mutex_unlock
+#include <pthread.h>
 // signal
 #include <signal.h>
 // printf, snprintf
@@ -51,7 +53,10 @@
 // exit
 #include <unistd.h>
 
+#include "buffer.h"
 #include "checksum.h"
+#include "copy.h"
+#include "flush.h"
 #include "log.h"
 #include "option.h"
 #include "util.h"
@@ -108,10 +113,14 @@ static void display() {
 	char * buffer = malloc(buffer_length + 1);
 
 	unsigned int j;
-	for (i = 0, j = 0; i < nb_working_workers; i++, j++) {
+	for (i = 0, j = 0; i < nb_working_workers && j < nb_total_workers; j++) {
 		struct worker * worker = workers + j;
-		while (worker->status != worker_status_running)
-			worker = workers + ++j;
+
+		pthread_mutex_lock(&worker->lock);
+		if (worker->status != worker_status_running) {
+			pthread_mutex_unlock(&worker->lock);
+			continue;
+		}
 
 		mvprintw(i + offset, 0, line);
 
@@ -146,8 +155,10 @@ static void display() {
 		else
 			attroff(COLOR_PAIR(4));
 		mvprintw(i + offset, width, "%s", buffer + wwidth);
+
+		pthread_mutex_unlock(&worker->lock);
+		i++;
 	}
-	worker_release();
 
 	free(buffer);
 
@@ -156,6 +167,13 @@ static void display() {
 	mvprintw(row - 1, 0, line);
 	mvprintw(row - 1, 1, "pCopy " PCOPY_VERSION);
 
+	unsigned long nb_written, nb_durable, nb_failed;
+	flush_get_stats(&nb_written, &nb_durable, &nb_failed);
+	if (nb_failed > 0)
+		mvprintw(row - 1, col / 2 - 16, gettext("durable: %lu/%lu, failed: %lu"), nb_durable, nb_written, nb_failed);
+	else
+		mvprintw(row - 1, col / 2 - 10, gettext("durable: %lu/%lu"), nb_durable, nb_written);
+
 	time_t now = time(NULL);
 
 	struct tm lnow;
@@ -177,29 +195,85 @@ int main(int argc, char * argv[]) {
 	textdomain("pcopy");
 
 	static struct pcopy_option option = {
-		.nb_jobs      = 0,
-		.load_average = 0,
+		.nb_jobs          = 0,
+		.load_average     = 0,
+		.queue_depth      = 8,
+		.direct_io        = false,
+		.split_size       = 1073741824,
+		.pipeline_depth   = 4,
+		.verify           = pcopy_verify_cached,
+		.verify_readahead = 0,
+		.sync             = pcopy_sync_file,
+		.sync_batch       = 64,
+		.write_behind     = 0,
+		.sparse           = pcopy_sparse_auto,
+		.preallocate      = true,
+		.nb_walkers       = 4,
+		.sort             = pcopy_sort_name,
+		.small_size       = 1048576,
+		.nb_small_jobs    = 0,
+		.group_files      = 32,
+		.nb_device_jobs   = 0,
+		.adaptive         = 0,
 	};
 
 	enum {
+		OPT_ADAPTIVE      = 'a',
+		OPT_BATCH         = 'b',
 		OPT_CHECKSUM      = 'c',
 		OPT_CHECKSUM_FILE = 'C',
+		OPT_COPY_ENGINE   = 'e',
+		OPT_DIRECT_IO     = 'd',
+		OPT_DEVICE_JOBS   = 'D',
+		OPT_GROUP         = 'g',
 		OPT_HELP          = 'h',
 		OPT_JOB           = 'j',
+		OPT_SMALL_JOBS    = 'J',
 		OPT_LOAD_AVERAGE  = 'l',
 		OPT_LOG_FILE      = 'L',
+		OPT_NO_PREALLOC   = 'n',
+		OPT_SORT          = 'o',
 		OPT_PAUSE         = 'p',
+		OPT_PIPELINE      = 'P',
+		OPT_QUEUE_DEPTH   = 'q',
+		OPT_READAHEAD     = 'r',
+		OPT_SPLIT_SIZE    = 's',
+		OPT_SYNC          = 'S',
+		OPT_SMALL_SIZE    = 't',
+		OPT_VERIFY        = 'v',
 		OPT_VERSION       = 'V',
+		OPT_WALKERS       = 'W',
+		OPT_WRITE_BEHIND  = 'w',
+		OPT_SPARSE        = 'z',
 	};
 
 	static struct option op[] = {
-		{ "checksum",      1, 0, OPT_CHECKSUM },
-		{ "checksum-file", 1, 0, OPT_CHECKSUM_FILE },
-		{ "help",          0, 0, OPT_HELP },
-		{ "jobs",          1, 0, OPT_JOB },
-		{ "load-average",  1, 0, OPT_LOAD_AVERAGE },
-		{ "pause",         0, 0, OPT_PAUSE },
-		{ "version",       0, 0, OPT_VERSION },
+		{ "adaptive",       1, 0, OPT_ADAPTIVE },
+		{ "checksum",       1, 0, OPT_CHECKSUM },
+		{ "checksum-file",  1, 0, OPT_CHECKSUM_FILE },
+		{ "copy-engine",    1, 0, OPT_COPY_ENGINE },
+		{ "device-jobs",    1, 0, OPT_DEVICE_JOBS },
+		{ "direct-io",      0, 0, OPT_DIRECT_IO },
+		{ "group",          1, 0, OPT_GROUP },
+		{ "help",           0, 0, OPT_HELP },
+		{ "jobs",           1, 0, OPT_JOB },
+		{ "load-average",   1, 0, OPT_LOAD_AVERAGE },
+		{ "no-preallocate", 0, 0, OPT_NO_PREALLOC },
+		{ "pause",          0, 0, OPT_PAUSE },
+		{ "pipeline",       1, 0, OPT_PIPELINE },
+		{ "queue-depth",    1, 0, OPT_QUEUE_DEPTH },
+		{ "readahead",      1, 0, OPT_READAHEAD },
+		{ "small-jobs",     1, 0, OPT_SMALL_JOBS },
+		{ "small-size",     1, 0, OPT_SMALL_SIZE },
+		{ "sort",           1, 0, OPT_SORT },
+		{ "sparse",         1, 0, OPT_SPARSE },
+		{ "split-size",     1, 0, OPT_SPLIT_SIZE },
+		{ "sync",           1, 0, OPT_SYNC },
+		{ "sync-batch",     1, 0, OPT_BATCH },
+		{ "verify",         1, 0, OPT_VERIFY },
+		{ "version",        0, 0, OPT_VERSION },
+		{ "walkers",        1, 0, OPT_WALKERS },
+		{ "write-behind",   1, 0, OPT_WRITE_BEHIND },
 
 		{ NULL, 0, 0, 0 },
 	};
@@ -208,11 +282,25 @@ int main(int argc, char * argv[]) {
 
 	static int lo;
 	for (;;) {
-		int c = getopt_long(argc, argv, "c:C:h?j:l:L:pV", op, &lo);
+		int c = getopt_long(argc, argv, "a:b:c:C:dD:e:g:h?j:J:l:L:no:pP:q:r:s:S:t:v:Vw:W:z:", op, &lo);
 		if (c == -1)
 			break;
 
 		switch (c) {
+			case OPT_ADAPTIVE:
+				if (sscanf(optarg, "%lf", &option.adaptive) < 1 || option.adaptive < 0) {
+					printf(gettext("Error: failed to parse argument for --adaptive parameter, '%s' should be a positive decimal\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_BATCH:
+				if (sscanf(optarg, "%u", &option.sync_batch) < 1 || option.sync_batch < 1) {
+					printf(gettext("Error: failed to parse argument for --sync-batch parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
 			case OPT_CHECKSUM:
 				if (!strcmp(optarg, "help")) {
 					struct checksum_driver * drivers = checksum_digests();
@@ -242,6 +330,46 @@ int main(int argc, char * argv[]) {
 				}
 				break;
 
+			case OPT_COPY_ENGINE:
+				if (!strcmp(optarg, "help")) {
+					struct copy_engine * engines = copy_engines();
+
+					printf(gettext("Available copy engines: "));
+					unsigned int i;
+					for (i = 0; engines->name != NULL; i++, engines++) {
+						if (i > 0)
+							printf(", ");
+						printf(gettext("'%s'"), engines->name);
+					}
+					printf("\n");
+
+					return 0;
+				}
+
+				if (!copy_set_default(optarg)) {
+					printf(gettext("Error: copy engine '%s' not found\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_DEVICE_JOBS:
+				if (sscanf(optarg, "%u", &option.nb_device_jobs) < 1) {
+					printf(gettext("Error: failed to parse argument for --device-jobs parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_DIRECT_IO:
+				option.direct_io = true;
+				break;
+
+			case OPT_GROUP:
+				if (sscanf(optarg, "%u", &option.group_files) < 1 || option.group_files < 1) {
+					printf(gettext("Error: failed to parse argument for --group parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
 			case OPT_HELP:
 				show_help();
 				return 0;
@@ -267,14 +395,129 @@ int main(int argc, char * argv[]) {
 				}
 				break;
 
+			case OPT_NO_PREALLOC:
+				option.preallocate = false;
+				break;
+
 			case OPT_PAUSE:
 				pause = true;
 				break;
 
+			case OPT_PIPELINE:
+				if (sscanf(optarg, "%u", &option.pipeline_depth) < 1) {
+					printf(gettext("Error: failed to parse argument for --pipeline parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_QUEUE_DEPTH:
+				if (sscanf(optarg, "%u", &option.queue_depth) < 1 || option.queue_depth < 1) {
+					printf(gettext("Error: failed to parse argument for --queue-depth parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_READAHEAD:
+				if (!util_parse_size(optarg, &option.verify_readahead)) {
+					printf(gettext("Error: failed to parse argument for --readahead parameter, '%s' should be a size like 512K or 8M\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_SMALL_JOBS:
+				if (sscanf(optarg, "%u", &option.nb_small_jobs) < 1) {
+					printf(gettext("Error: failed to parse argument for --small-jobs parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_SMALL_SIZE:
+				if (!util_parse_size(optarg, &option.small_size)) {
+					printf(gettext("Error: failed to parse argument for --small-size parameter, '%s' should be a size like 64K or 1M\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_SORT:
+				if (!strcmp(optarg, "none"))
+					option.sort = pcopy_sort_none;
+				else if (!strcmp(optarg, "name"))
+					option.sort = pcopy_sort_name;
+				else if (!strcmp(optarg, "inode"))
+					option.sort = pcopy_sort_inode;
+				else {
+					printf(gettext("Error: failed to parse argument for --sort parameter, '%s' should be 'none', 'name' or 'inode'\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_SPARSE:
+				if (!strcmp(optarg, "never"))
+					option.sparse = pcopy_sparse_never;
+				else if (!strcmp(optarg, "auto"))
+					option.sparse = pcopy_sparse_auto;
+				else if (!strcmp(optarg, "always"))
+					option.sparse = pcopy_sparse_always;
+				else {
+					printf(gettext("Error: failed to parse argument for --sparse parameter, '%s' should be 'never', 'auto' or 'always'\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_SPLIT_SIZE:
+				if (!util_parse_size(optarg, &option.split_size)) {
+					printf(gettext("Error: failed to parse argument for --split-size parameter, '%s' should be a size like 512M or 2G\n"), optarg);
+					return 1;
+				}
+
+				// chunks should be aligned for O_DIRECT and clone of range
+				option.split_size = buffer_align(option.split_size);
+				break;
+
+			case OPT_SYNC:
+				if (!strcmp(optarg, "file"))
+					option.sync = pcopy_sync_file;
+				else if (!strcmp(optarg, "batch"))
+					option.sync = pcopy_sync_batch;
+				else if (!strcmp(optarg, "fs"))
+					option.sync = pcopy_sync_filesystem;
+				else {
+					printf(gettext("Error: failed to parse argument for --sync parameter, '%s' should be 'file', 'batch' or 'fs'\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_VERIFY:
+				if (!strcmp(optarg, "cached"))
+					option.verify = pcopy_verify_cached;
+				else if (!strcmp(optarg, "drop-cache"))
+					option.verify = pcopy_verify_drop_cache;
+				else if (!strcmp(optarg, "direct"))
+					option.verify = pcopy_verify_direct;
+				else {
+					printf(gettext("Error: failed to parse argument for --verify parameter, '%s' should be 'cached', 'drop-cache' or 'direct'\n"), optarg);
+					return 1;
+				}
+				break;
+
 			case OPT_VERSION:
 				printf(gettext("pCopy: parallel copying and checksumming\n"));
 				printf(gettext("version: %s, build: %s %s\n"), PCOPY_VERSION, __DATE__, __TIME__);
 				return 0;
+
+			case OPT_WALKERS:
+				if (sscanf(optarg, "%u", &option.nb_walkers) < 1 || option.nb_walkers < 1) {
+					printf(gettext("Error: failed to parse argument for --walkers parameter, '%s' should be an positive integer\n"), optarg);
+					return 1;
+				}
+				break;
+
+			case OPT_WRITE_BEHIND:
+				if (!util_parse_size(optarg, &option.write_behind)) {
+					printf(gettext("Error: failed to parse argument for --write-behind parameter, '%s' should be a size like 8M\n"), optarg);
+					return 1;
+				}
+				break;
 		}
 	}
 
@@ -312,19 +555,14 @@ int main(int argc, char * argv[]) {
 	attroff(COLOR_PAIR(3));
 	refresh();
 
-	sleep(1);
-
-	while (!worker_finished()) {
-		sleep(1);
+	// the screen is refreshed every second but the program ends as soon as the copy does
+	while (!worker_wait(1000))
 		display();
-	}
 
 	display();
 
 	if (pause)
 		getch();
-	else
-		sleep(5);
 
 	endwin();
 
@@ -342,13 +580,51 @@ static void quit(int signal __attribute__((unused))) {
 static void show_help() {
 	printf("pCopy (" PCOPY_VERSION ")\n");
 	printf(gettext("Usage: pcopy [options] <src-files>... <dest-file>\n"));
-	printf(gettext("  -c, --checksum <hash>      : Use <hash> as hash function,\n"));
+	printf(gettext("  -a, --adaptive <seconds>   : Tune the number of running jobs from the throughput measured every <seconds>,\n"));
+	printf(gettext("                               between 1 and four times --jobs and --small-jobs, 0 disables it, default value: 0\n"));
+	printf(gettext("  -b, --sync-batch <files>   : Flush files by groups of <files> with 'batch' policy, default value: 64\n"));
+	printf(gettext("  -c, --checksum <hash>      : Use <hash> as hash function, a comma separated list (e.g. md5,sha256)\n"));
+	printf(gettext("                               computes each digest in the same pass and writes 'name:digest' of each of them,\n"));
 	printf(gettext("                               Use 'help' to show available hash functions\n"));
 	printf(gettext("  -C, --checksum-file <file> : Defer checksum checking after copy and write checksum into <file>\n"));
+	printf(gettext("  -d, --direct-io            : Bypass page cache by reading and writing files with O_DIRECT\n"));
+	printf(gettext("  -D, --device-jobs <jobs>   : Copy at most <jobs> files simultaneously between two devices,\n"));
+	printf(gettext("                               0 guesses it from /sys/block (2 for rotational disks), default value: 0\n"));
+	printf(gettext("  -e, --copy-engine <engine> : Copy data with <engine> first and fall back to the next ones,\n"));
+	printf(gettext("                               default: reflink, then copy_file_range, then io_uring, then read_write\n"));
+	printf(gettext("                               Use 'help' to show available copy engines\n"));
+	printf(gettext("  -g, --group <files>        : Copy up to <files> small files of a directory one after another in one job,\n"));
+	printf(gettext("                               1 disables it, default value: 32\n"));
 	printf(gettext("  -h, --help                 : Show this and exit\n"));
-	printf(gettext("  -j, --jobs <jobs>          : Run <jobs> simultaneously, default value: number of cpus\n"));
+	printf(gettext("  -j, --jobs <jobs>          : Copy <jobs> files bigger than --small-size simultaneously, default value: number of cpus\n"));
+	printf(gettext("  -J, --small-jobs <jobs>    : Copy <jobs> small files simultaneously, default value: twice the number of cpus\n"));
 	printf(gettext("  -l, --load-average <load>  : Do not copy while load average exceed <load> in the last minute\n"));
 	printf(gettext("  -L, --log-file <file>      : Log also into <file>\n"));
-	printf(gettext("  -p, --pause                : Pause at the end of copy\n\n"));
+	printf(gettext("  -n, --no-preallocate       : Do not allocate the whole destination file before copying it\n"));
+	printf(gettext("  -o, --sort <order>         : Process entries of directories by 'name', by 'inode' or as they are read ('none'),\n"));
+	printf(gettext("                               default value: name\n"));
+	printf(gettext("  -p, --pause                : Pause at the end of copy\n"));
+	printf(gettext("  -P, --pipeline <buffers>   : Hash files in another thread through a ring of <buffers> buffers,\n"));
+	printf(gettext("                               only hashing is overlapped, reads and writes still alternate,\n"));
+	printf(gettext("                               0 disables it, default value: 4\n"));
+	printf(gettext("  -q, --queue-depth <depth>  : Keep up to <depth> reads and writes in flight per file with io_uring engine,\n"));
+	printf(gettext("                               default value: 8\n"));
+	printf(gettext("  -r, --readahead <size>     : Read ahead at most <size> while verifying files through page cache,\n"));
+	printf(gettext("                               0 lets the kernel choose, default value: 0\n"));
+	printf(gettext("  -s, --split-size <size>    : Split files bigger than <size> into chunks of <size> copied by several jobs,\n"));
+	printf(gettext("                               0 disables it, default value: 1G\n"));
+	printf(gettext("  -S, --sync <policy>        : Make files durable with one fsync per file ('file'), with fsync by groups\n"));
+	printf(gettext("                               in another thread ('batch') or with one syncfs per filesystem at the end ('fs'),\n"));
+	printf(gettext("                               default value: file\n"));
+	printf(gettext("  -t, --small-size <size>    : Copy files up to <size> in their own lane so they do not wait behind big files,\n"));
+	printf(gettext("                               0 puts every file in the same lane, default value: 1M\n"));
+	printf(gettext("  -v, --verify <mode>        : Read files back for verification from page cache ('cached'),\n"));
+	printf(gettext("                               after dropping their cached pages ('drop-cache') or with O_DIRECT ('direct'),\n"));
+	printf(gettext("                               default value: cached\n"));
+	printf(gettext("  -w, --write-behind <size>  : Start writeback every <size> written and drop previous windows from page cache,\n"));
+	printf(gettext("                               0 disables it, default value: 0\n"));
+	printf(gettext("  -W, --walkers <walkers>    : List directories with <walkers> threads, default value: 4\n"));
+	printf(gettext("  -z, --sparse <mode>        : Never create holes ('never'), recreate holes of sparse files ('auto')\n"));
+	printf(gettext("                               or also turn every block of zeros into a hole ('always'), default value: auto\n\n"));
 }
 
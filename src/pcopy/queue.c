@@ -0,0 +1,202 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#define _GNU_SOURCE
+// sem_destroy, sem_getvalue, sem_init, sem_post, sem_trywait, sem_wait
+#include <semaphore.h>
+// true
+#include <stdbool.h>
+// aligned_alloc, free, malloc
+#include <stdlib.h>
+// clock_gettime
+#include <time.h>
+
+#include "queue.h"
+
+#define QUEUE_CACHE_LINE 64
+
+struct queue_cell {
+	unsigned long sequence;
+	void * item;
+};
+
+struct queue {
+	struct queue_cell * cells;
+	unsigned long mask;
+
+	sem_t nb_free;
+	sem_t nb_items;
+
+	// both ends are written by different threads, keep them on their own cache line
+	unsigned long enqueue __attribute__((aligned(QUEUE_CACHE_LINE)));
+	unsigned long dequeue __attribute__((aligned(QUEUE_CACHE_LINE)));
+
+	unsigned long nb_pushed __attribute__((aligned(QUEUE_CACHE_LINE)));
+	unsigned long nb_popped;
+	unsigned long nb_retries;
+	unsigned long nb_push_waits;
+	unsigned long nb_pop_waits;
+	unsigned long push_wait;
+	unsigned long pop_wait;
+};
+
+static void queue_wait(sem_t * sem, unsigned long * nb_waits, unsigned long * wait_time);
+
+
+void queue_free(struct queue * queue) {
+	if (queue == NULL)
+		return;
+
+	sem_destroy(&queue->nb_free);
+	sem_destroy(&queue->nb_items);
+	free(queue->cells);
+	free(queue);
+}
+
+void queue_get_stats(struct queue * queue, struct queue_stats * stats) {
+	stats->nb_pushed = __atomic_load_n(&queue->nb_pushed, __ATOMIC_RELAXED);
+	stats->nb_popped = __atomic_load_n(&queue->nb_popped, __ATOMIC_RELAXED);
+	stats->nb_retries = __atomic_load_n(&queue->nb_retries, __ATOMIC_RELAXED);
+	stats->nb_push_waits = __atomic_load_n(&queue->nb_push_waits, __ATOMIC_RELAXED);
+	stats->nb_pop_waits = __atomic_load_n(&queue->nb_pop_waits, __ATOMIC_RELAXED);
+	stats->push_wait = __atomic_load_n(&queue->push_wait, __ATOMIC_RELAXED) / 1e9;
+	stats->pop_wait = __atomic_load_n(&queue->pop_wait, __ATOMIC_RELAXED) / 1e9;
+}
+
+struct queue * queue_new(unsigned int capacity) {
+	// capacity is rounded up to a power of two so that positions are masked
+	unsigned long size = 2;
+	while (size < capacity)
+		size <<= 1;
+
+	struct queue * queue = aligned_alloc(QUEUE_CACHE_LINE, sizeof(struct queue));
+	if (queue == NULL)
+		return NULL;
+
+	queue->cells = malloc(size * sizeof(struct queue_cell));
+	if (queue->cells == NULL) {
+		free(queue);
+		return NULL;
+	}
+
+	unsigned long i;
+	for (i = 0; i < size; i++)
+		queue->cells[i].sequence = i;
+
+	queue->mask = size - 1;
+	queue->enqueue = queue->dequeue = 0;
+
+	sem_init(&queue->nb_free, 0, capacity);
+	sem_init(&queue->nb_items, 0, 0);
+
+	queue->nb_pushed = queue->nb_popped = queue->nb_retries = 0;
+	queue->nb_push_waits = queue->nb_pop_waits = 0;
+	queue->push_wait = queue->pop_wait = 0;
+
+	return queue;
+}
+
+void * queue_pop(struct queue * queue) {
+	if (sem_trywait(&queue->nb_items) != 0)
+		queue_wait(&queue->nb_items, &queue->nb_pop_waits, &queue->pop_wait);
+
+	// an item is reserved for us, only its position is still to be claimed
+	struct queue_cell * cell;
+	unsigned long position = __atomic_load_n(&queue->dequeue, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = queue->cells + (position & queue->mask);
+		unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence == position + 1 && __atomic_compare_exchange_n(&queue->dequeue, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+
+		if (sequence != position + 1)
+			position = __atomic_load_n(&queue->dequeue, __ATOMIC_RELAXED);
+
+		__atomic_add_fetch(&queue->nb_retries, 1, __ATOMIC_RELAXED);
+	}
+
+	void * item = cell->item;
+	__atomic_store_n(&cell->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+
+	sem_post(&queue->nb_free);
+	__atomic_add_fetch(&queue->nb_popped, 1, __ATOMIC_RELAXED);
+
+	return item;
+}
+
+void queue_push(struct queue * queue, void * item) {
+	if (sem_trywait(&queue->nb_free) != 0)
+		queue_wait(&queue->nb_free, &queue->nb_push_waits, &queue->push_wait);
+
+	struct queue_cell * cell;
+	unsigned long position = __atomic_load_n(&queue->enqueue, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = queue->cells + (position & queue->mask);
+		unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence == position && __atomic_compare_exchange_n(&queue->enqueue, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+
+		if (sequence != position)
+			position = __atomic_load_n(&queue->enqueue, __ATOMIC_RELAXED);
+
+		__atomic_add_fetch(&queue->nb_retries, 1, __ATOMIC_RELAXED);
+	}
+
+	cell->item = item;
+	__atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+	sem_post(&queue->nb_items);
+	__atomic_add_fetch(&queue->nb_pushed, 1, __ATOMIC_RELAXED);
+}
+
+unsigned int queue_size(struct queue * queue) {
+	int nb_items = 0;
+	sem_getvalue(&queue->nb_items, &nb_items);
+	return nb_items > 0 ? nb_items : 0;
+}
+
+static void queue_wait(sem_t * sem, unsigned long * nb_waits, unsigned long * wait_time) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (sem_wait(sem) != 0)
+		continue;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	unsigned long elapsed = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec;
+
+	__atomic_add_fetch(nb_waits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(wait_time, elapsed, __ATOMIC_RELAXED);
+}
+
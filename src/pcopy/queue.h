@@ -0,0 +1,65 @@
+/****************************************************************************\
+*                                 _____                                      *
+*                           ___  / ___/__  ___  __ __                        *
+*                          / _ \/ /__/ _ \/ _ \/ // /                        *
+*                         / .__/\___/\___/ .__/\_, /                         *
+*                        /_/            /_/   /___/                          *
+*  ------------------------------------------------------------------------  *
+*  This file is a part of pCopy                                              *
+*                                                                            *
+*  pCopy is free software; you can redistribute it and/or                    *
+*  modify it under the terms of the GNU General Public License               *
+*  as published by the Free Software Foundation; either version 3            *
+*  of the License, or (at your option) any later version.                    *
+*                                                                            *
+*  This program is distributed in the hope that it will be useful,           *
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the             *
+*  GNU General Public License for more details.                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program; if not, write to the Free Software               *
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor,                        *
+*  Boston, MA  02110-1301, USA.                                              *
+*                                                                            *
+*  You should have received a copy of the GNU General Public License         *
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.     *
+*                                                                            *
+*  ------------------------------------------------------------------------  *
+*  Copyright (C) 2015, Guillaume Clercin <clercin.guillaume@gmail.com>       *
+\****************************************************************************/
+
+#ifndef __PCOPY_QUEUE_H__
+#define __PCOPY_QUEUE_H__
+
+/**
+ * Bounded multi-producer multi-consumer queue (D. Vyukov's algorithm).
+ * Each slot carries a sequence number so producers and consumers only
+ * race on their own end with a compare-and-swap, there is no lock.
+ * Two semaphores count free slots and queued items: push blocks while
+ * the queue is full, pop blocks while it is empty.
+ */
+struct queue;
+
+struct queue_stats {
+	unsigned long nb_pushed;
+	unsigned long nb_popped;
+	// failed compare-and-swap, i.e. other threads raced on the same end
+	unsigned long nb_retries;
+
+	// how many times and how long (in seconds) callers have been blocked
+	unsigned long nb_push_waits;
+	unsigned long nb_pop_waits;
+	double push_wait;
+	double pop_wait;
+};
+
+void queue_free(struct queue * queue);
+void queue_get_stats(struct queue * queue, struct queue_stats * stats);
+struct queue * queue_new(unsigned int capacity);
+void * queue_pop(struct queue * queue);
+void queue_push(struct queue * queue, void * item);
+unsigned int queue_size(struct queue * queue);
+
+#endif
+
@@ -30,232 +30,261 @@
 \****************************************************************************/
 
 #define _GNU_SOURCE
-// open
-#include <fcntl.h>
 // gettext
 #include <libintl.h>
 // pthread_attr_destroy, pthread_attr_init, pthread_attr_setdetachstate
-// pthread_cond_init, pthread_cond_signal, pthread_cond_timedwait
-// pthread_create, pthread_join, pthread_mutex_init, pthread_mutex_lock
-// pthread_mutex_unlock
+// pthread_cond_signal, pthread_cond_wait, pthread_create,
+// pthread_mutex_lock, pthread_mutex_unlock
 #include <pthread.h>
-// free, malloc, realloc
+// bool
+#include <stdbool.h>
+// free, malloc
 #include <stdlib.h>
-// asprintf
+// snprintf
 #include <stdio.h>
-// strdup
+// strcmp, strncpy
 #include <string.h>
-// open
-#include <sys/stat.h>
-// syscall
-#include <sys/syscall.h>
-// gettimeofday, setpriority
-#include <sys/time.h>
-// pid_t, open
-#include <sys/types.h>
-// close, getpid, syscall, write
-#include <unistd.h>
+// prctl, PR_SET_NAME
+#include <sys/prctl.h>
 
+#include "deque.h"
 #include "log.h"
 #include "thread.h"
 #include "util.h"
 
+#define THREAD_POOL_MAX_THREADS 1024
+#define THREAD_POOL_NAME_LENGTH 16
 
+/**
+ * Threads of the pool live until the program exits. Each one owns a deque of
+ * tasks: tasks submitted by a thread of the pool go into its own deque and
+ * idle threads steal from the others. A new thread is only created when a
+ * task is submitted while no thread is sleeping, because most tasks (walkers,
+ * workers, hashers) block for a long time waiting on something else.
+ */
 struct thread_pool_thread {
 	pthread_t thread;
-	pthread_mutex_t lock;
-	pthread_cond_t wait;
+	unsigned int index;
+	struct deque * tasks;
 
-	char * name;
+	char name[THREAD_POOL_NAME_LENGTH];
+
+	volatile unsigned long nb_run;
+	volatile unsigned long nb_steals;
+};
+
+struct thread_pool_task {
 	thread_pool_f function;
 	void * arg;
-
-	volatile enum {
-		thread_pool_state_exited,
-		thread_pool_state_running,
-		thread_pool_state_waiting,
-	} state;
+	char name[THREAD_POOL_NAME_LENGTH];
 };
 
-static struct thread_pool_thread ** thread_pool_threads = NULL;
+static struct thread_pool_thread * thread_pool_threads[THREAD_POOL_MAX_THREADS];
 static unsigned int thread_pool_nb_threads = 0;
-static pthread_mutex_t thread_pool_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pid_t thread_pool_pid = -1;
-
-static void thread_pool_exit(void) __attribute__((destructor));
-static void thread_pool_init(void) __attribute__((constructor));
-static void thread_pool_set_name(pid_t tid, const char * name);
+static unsigned int thread_pool_next = 0;
+static __thread struct thread_pool_thread * thread_pool_current = NULL;
+
+// only taken to create threads, to sleep and to wake them up
+static pthread_mutex_t thread_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_pool_wait = PTHREAD_COND_INITIALIZER;
+static unsigned int thread_pool_nb_idle = 0;
+static unsigned int thread_pool_nb_wakeups = 0;
+static unsigned long thread_pool_nb_queued = 0;
+
+static struct thread_pool_thread * thread_pool_new_thread(void);
+static struct thread_pool_task * thread_pool_next_task(struct thread_pool_thread * th);
+static int thread_pool_push(const char * thread_name, thread_pool_f function, void * arg, bool may_create);
+static void thread_pool_set_name(struct thread_pool_thread * th, const char * name);
 static void * thread_pool_work(void * arg);
 
 
-static void thread_pool_exit() {
-	unsigned int i;
-	for (i = 0; i < thread_pool_nb_threads; i++) {
-		struct thread_pool_thread * th = thread_pool_threads[i];
+void thread_pool_get_stats(struct thread_pool_stats * stats) {
+	pthread_mutex_lock(&thread_pool_lock);
+	stats->nb_threads = thread_pool_nb_threads;
+	stats->nb_idle = thread_pool_nb_idle;
+	pthread_mutex_unlock(&thread_pool_lock);
 
-		pthread_mutex_lock(&th->lock);
-		if (th->state == thread_pool_state_waiting)
-			pthread_cond_signal(&th->wait);
-		pthread_mutex_unlock(&th->lock);
+	stats->nb_queued = __atomic_load_n(&thread_pool_nb_queued, __ATOMIC_RELAXED);
 
-		pthread_join(th->thread, NULL);
+	stats->nb_run = stats->nb_steals = 0;
 
-		free(th);
+	unsigned int i;
+	for (i = 0; i < stats->nb_threads; i++) {
+		stats->nb_run += thread_pool_threads[i]->nb_run;
+		stats->nb_steals += thread_pool_threads[i]->nb_steals;
 	}
-
-	free(thread_pool_threads);
-	thread_pool_threads = NULL;
-	thread_pool_nb_threads = 0;
 }
 
-static void thread_pool_init() {
-	thread_pool_pid = getpid();
-}
+static struct thread_pool_thread * thread_pool_new_thread() {
+	if (thread_pool_nb_threads == THREAD_POOL_MAX_THREADS)
+		return NULL;
 
-int thread_pool_run(const char * thread_name, void (*function)(void * arg), void * arg) {
-	pthread_mutex_lock(&thread_pool_lock);
-	unsigned int i;
-	for (i = 0; i < thread_pool_nb_threads; i++) {
-		struct thread_pool_thread * th = thread_pool_threads[i];
+	struct thread_pool_thread * th = malloc(sizeof(struct thread_pool_thread));
+	if (th == NULL)
+		return NULL;
 
-		if (th->state == thread_pool_state_waiting) {
-			pthread_mutex_lock(&th->lock);
+	th->index = thread_pool_nb_threads;
+	th->tasks = deque_new();
+	th->name[0] = '\0';
+	th->nb_run = th->nb_steals = 0;
 
-			th->name = NULL;
-			if (thread_name != NULL)
-				th->name = strdup(thread_name);
-			th->function = function;
-			th->arg = arg;
-			th->state = thread_pool_state_running;
+	if (th->tasks == NULL) {
+		free(th);
+		return NULL;
+	}
 
-			pthread_cond_signal(&th->wait);
-			pthread_mutex_unlock(&th->lock);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-			pthread_mutex_unlock(&thread_pool_lock);
+	int failed = pthread_create(&th->thread, &attr, thread_pool_work, th);
 
-			return 0;
-		}
+	pthread_attr_destroy(&attr);
+
+	if (failed != 0) {
+		deque_free(th->tasks);
+		free(th);
+		return NULL;
 	}
 
-	for (i = 0; i < thread_pool_nb_threads; i++) {
-		struct thread_pool_thread * th = thread_pool_threads[i];
+	// published last, stealers only look at threads below thread_pool_nb_threads
+	thread_pool_threads[th->index] = th;
+	__atomic_store_n(&thread_pool_nb_threads, th->index + 1, __ATOMIC_RELEASE);
 
-		if (th->state == thread_pool_state_exited) {
-			th->name = NULL;
-			if (thread_name != NULL)
-				th->name = strdup(thread_name);
-			th->function = function;
-			th->arg = arg;
-			th->state = thread_pool_state_running;
+	return th;
+}
 
-			pthread_attr_t attr;
-			pthread_attr_init(&attr);
-			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+static struct thread_pool_task * thread_pool_next_task(struct thread_pool_thread * th) {
+	struct thread_pool_task * task = deque_pop(th->tasks);
+	if (task != NULL)
+		return task;
 
-			pthread_create(&th->thread, &attr, thread_pool_work, th);
+	unsigned int nb_threads = __atomic_load_n(&thread_pool_nb_threads, __ATOMIC_ACQUIRE);
 
-			pthread_mutex_unlock(&thread_pool_lock);
+	unsigned int i;
+	for (i = 1; i < nb_threads && task == NULL; i++)
+		task = deque_steal(thread_pool_threads[(th->index + i) % nb_threads]->tasks);
 
-			pthread_attr_destroy(&attr);
+	if (task != NULL)
+		th->nb_steals++;
 
-			return 0;
-		}
-	}
+	return task;
+}
 
-	void * new_addr = realloc(thread_pool_threads, (thread_pool_nb_threads + 1) * sizeof(struct so_thread_pool_thread *));
-	if (new_addr == NULL) {
+static int thread_pool_push(const char * thread_name, thread_pool_f function, void * arg, bool may_create) {
+	struct thread_pool_task * task = malloc(sizeof(struct thread_pool_task));
+	if (task == NULL) {
 		log_write(gettext("thread_pool_run: error, not enought memory to start new thread"));
 		return 1;
 	}
 
-	thread_pool_threads = new_addr;
-	struct thread_pool_thread * th = thread_pool_threads[thread_pool_nb_threads] = malloc(sizeof(struct thread_pool_thread));
-	thread_pool_nb_threads++;
-
-	th->name = NULL;
+	task->function = function;
+	task->arg = arg;
 	if (thread_name != NULL)
-		th->name = strdup(thread_name);
-	th->function = function;
-	th->arg = arg;
-	th->state = thread_pool_state_running;
+		strncpy(task->name, thread_name, THREAD_POOL_NAME_LENGTH);
+	else
+		snprintf(task->name, THREAD_POOL_NAME_LENGTH, "thread %p", function);
+	task->name[THREAD_POOL_NAME_LENGTH - 1] = '\0';
 
-	pthread_mutex_init(&th->lock, NULL);
-	pthread_cond_init(&th->wait, NULL);
+	pthread_mutex_lock(&thread_pool_lock);
 
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	/**
+	 * Each task reserves one sleeping thread, or a new one, as a task may
+	 * block its thread forever. A thread of the pool keeps its tasks in its
+	 * own deque, the thread woken up steals them.
+	 */
+	bool wake_up = thread_pool_nb_idle > thread_pool_nb_wakeups;
 
-	pthread_create(&th->thread, &attr, thread_pool_work, th);
+	if (!wake_up && !may_create) {
+		pthread_mutex_unlock(&thread_pool_lock);
+		free(task);
+		return 1;
+	}
 
-	pthread_mutex_unlock(&thread_pool_lock);
+	struct thread_pool_thread * th = thread_pool_current;
+	if (!wake_up)
+		th = thread_pool_new_thread();
+	else if (th == NULL)
+		th = thread_pool_threads[thread_pool_next++ % thread_pool_nb_threads];
 
-	pthread_attr_destroy(&attr);
+	if (th == NULL || !deque_push(th->tasks, task)) {
+		pthread_mutex_unlock(&thread_pool_lock);
+
+		log_write(gettext("thread_pool_run: error, failed to start new thread"));
+		free(task);
+		return 1;
+	}
+
+	__atomic_add_fetch(&thread_pool_nb_queued, 1, __ATOMIC_RELAXED);
+
+	if (wake_up) {
+		thread_pool_nb_wakeups++;
+		pthread_cond_signal(&thread_pool_wait);
+	}
+
+	pthread_mutex_unlock(&thread_pool_lock);
 
 	return 0;
 }
 
-static void thread_pool_set_name(pid_t tid, const char * name) {
-	char * path;
-	int size = asprintf(&path, "/proc/%d/task/%d/comm", thread_pool_pid, tid);
-	if (size < 0)
-		return;
+int thread_pool_run(const char * thread_name, thread_pool_f function, void * arg) {
+	return thread_pool_push(thread_name, function, arg, true);
+}
 
-	int fd = open(path, O_WRONLY);
-	if (fd < 0) {
-		free(path);
+static void thread_pool_set_name(struct thread_pool_thread * th, const char * name) {
+	if (strcmp(th->name, name) == 0)
 		return;
-	}
 
-	char * th_name = strdup(name);
-	util_string_middle_elipsis(th_name, 15);
+	strcpy(th->name, name);
+
+	char th_name[THREAD_POOL_NAME_LENGTH];
+	strcpy(th_name, name);
+	util_string_middle_elipsis(th_name, THREAD_POOL_NAME_LENGTH - 1);
+
+	prctl(PR_SET_NAME, th_name, 0, 0, 0);
+}
 
-	write(fd, th_name, strlen(th_name) + 1);
-	close(fd);
-	free(path);
-	free(th_name);
+/**
+ * Same as thread_pool_run but only hands the task to a sleeping thread,
+ * for work the caller can as well do by itself
+ */
+int thread_pool_try_run(const char * thread_name, thread_pool_f function, void * arg) {
+	return thread_pool_push(thread_name, function, arg, false);
 }
 
 static void * thread_pool_work(void * arg) {
 	struct thread_pool_thread * th = arg;
+	thread_pool_current = th;
 
-	pid_t tid = syscall(SYS_gettid);
+	for (;;) {
+		struct thread_pool_task * task = thread_pool_next_task(th);
 
-	do {
-		if (th->name != NULL)
-			thread_pool_set_name(tid, th->name);
-		else {
-			char buffer[16];
-			snprintf(buffer, 16, "thread %p", th->function);
-			thread_pool_set_name(tid, buffer);
-		}
-
-		th->function(th->arg);
-
-		thread_pool_set_name(tid, "idle");
-
-		free(th->name);
-		th->name = NULL;
+		if (task == NULL) {
+			pthread_mutex_lock(&thread_pool_lock);
 
-		pthread_mutex_lock(&th->lock);
+			// a task queued meanwhile is in one of the deques, look again
+			if (__atomic_load_n(&thread_pool_nb_queued, __ATOMIC_RELAXED) == 0) {
+				thread_pool_nb_idle++;
+				while (thread_pool_nb_wakeups == 0)
+					pthread_cond_wait(&thread_pool_wait, &thread_pool_lock);
+				thread_pool_nb_wakeups--;
+				thread_pool_nb_idle--;
+			}
 
-		th->function = NULL;
-		th->arg = NULL;
-		th->state = thread_pool_state_waiting;
+			pthread_mutex_unlock(&thread_pool_lock);
+			continue;
+		}
 
-		struct timeval now;
-		struct timespec timeout;
-		gettimeofday(&now, NULL);
-		timeout.tv_sec = now.tv_sec + 300;
-		timeout.tv_nsec = now.tv_usec * 1000;
+		__atomic_sub_fetch(&thread_pool_nb_queued, 1, __ATOMIC_RELAXED);
 
-		pthread_cond_timedwait(&th->wait, &th->lock, &timeout);
+		// renaming is one syscall and only done when the task changes
+		thread_pool_set_name(th, task->name);
 
-		if (th->state != thread_pool_state_running)
-			th->state = thread_pool_state_exited;
+		th->nb_run++;
+		task->function(task->arg);
 
-		pthread_mutex_unlock(&th->lock);
-	} while (th->state == thread_pool_state_running);
+		free(task);
+	}
 
 	return NULL;
 }
@@ -34,7 +34,19 @@
 
 typedef void (*thread_pool_f)(void * arg);
 
+struct thread_pool_stats {
+	unsigned int nb_threads;
+	unsigned int nb_idle;
+	// tasks pushed in a deque but not started yet
+	unsigned long nb_queued;
+
+	unsigned long nb_run;
+	unsigned long nb_steals;
+};
+
+void thread_pool_get_stats(struct thread_pool_stats * stats);
 int thread_pool_run(const char * thread_name, thread_pool_f callback, void * arg);
+int thread_pool_try_run(const char * thread_name, thread_pool_f callback, void * arg);
 
 #endif
 
@@ -30,8 +30,6 @@
 \****************************************************************************/
 
 #define _GNU_SOURCE
-// dirent
-#include <dirent.h>
 // open
 #include <fcntl.h>
 // pthread_mutex_lock
@@ -44,6 +42,8 @@
 #include <string.h>
 // open
 #include <sys/stat.h>
+// major, minor
+#include <sys/sysmacros.h>
 // open
 #include <sys/types.h>
 // clock_gettime
@@ -54,20 +54,11 @@
 #include "util.h"
 #include "worker.h"
 
+static bool util_read_sysfs(const char * path, unsigned int * value);
 static int util_string_valid_utf8_char(const char * string);
 static int util_string_valid_utf8_char2(const unsigned char * ptr, unsigned short length);
 
 
-int util_basic_filter(const struct dirent * file) {
-	if (file->d_name[0] != '.')
-		return 1;
-
-	if (file->d_name[1] == '\0')
-		return 0;
-
-	return file->d_name[1] != '.' || file->d_name[2] != '\0';
-}
-
 void util_check_load_average(struct worker * worker, double limit) {
 	if (limit < 0.5)
 		return;
@@ -109,6 +100,67 @@ void util_check_load_average(struct worker * worker, double limit) {
 
 }
 
+/**
+ * GCC vector extension: 32 bytes are or-ed at once, with AVX2 when the cpu
+ * has it and with pairs of SSE2 registers otherwise
+ */
+typedef unsigned long long util_vector_t __attribute__((vector_size(32), aligned(1)));
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+bool util_is_zero(const void * buffer, size_t length) {
+	const unsigned char * ptr = buffer;
+
+	while (length >= 4 * sizeof(util_vector_t)) {
+		const util_vector_t * vector = (const util_vector_t *) ptr;
+		util_vector_t acc = vector[0] | vector[1] | vector[2] | vector[3];
+
+		if ((acc[0] | acc[1] | acc[2] | acc[3]) != 0)
+			return false;
+
+		ptr += 4 * sizeof(util_vector_t);
+		length -= 4 * sizeof(util_vector_t);
+	}
+
+	while (length > 0) {
+		if (*ptr != 0)
+			return false;
+
+		ptr++;
+		length--;
+	}
+
+	return true;
+}
+
+bool util_device_queue(dev_t device, bool * rotational, unsigned int * nr_requests) {
+	// a partition has no queue of its own, it is found on its disk
+	static const char * formats[] = {
+		"/sys/dev/block/%u:%u/queue/%s",
+		"/sys/dev/block/%u:%u/../queue/%s",
+	};
+
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		char path[64];
+		unsigned int value;
+
+		snprintf(path, 64, formats[i], major(device), minor(device), "rotational");
+		if (!util_read_sysfs(path, &value))
+			continue;
+		*rotational = value != 0;
+
+		snprintf(path, 64, formats[i], major(device), minor(device), "nr_requests");
+		if (!util_read_sysfs(path, nr_requests))
+			*nr_requests = 0;
+
+		return true;
+	}
+
+	return false;
+}
+
 unsigned int util_nb_cpus() {
 	int fd = open("/sys/devices/system/cpu/present", O_RDONLY);
 	if (fd < 0)
@@ -129,6 +181,59 @@ unsigned int util_nb_cpus() {
 	return nb_parsed == 2 ? last - first + 1 : 1;
 }
 
+static bool util_read_sysfs(const char * path, unsigned int * value) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	char buffer[16];
+	ssize_t nb_read = read(fd, buffer, 15);
+	close(fd);
+
+	if (nb_read <= 0)
+		return false;
+
+	buffer[nb_read] = '\0';
+
+	return sscanf(buffer, "%u", value) == 1;
+}
+
+bool util_parse_size(const char * string, off_t * size) {
+	long long value;
+	char unit = '\0';
+
+	int nb_parsed = sscanf(string, "%lld%c", &value, &unit);
+	if (nb_parsed < 1 || value < 0)
+		return false;
+
+	switch (unit) {
+		case 'T':
+		case 't':
+			value <<= 10;
+			// fall through
+		case 'G':
+		case 'g':
+			value <<= 10;
+			// fall through
+		case 'M':
+		case 'm':
+			value <<= 10;
+			// fall through
+		case 'K':
+		case 'k':
+			value <<= 10;
+			// fall through
+		case '\0':
+			break;
+
+		default:
+			return false;
+	}
+
+	*size = value;
+	return true;
+}
+
 size_t util_string_length(const char * string) {
 	if (string == NULL)
 		return 0;
@@ -32,15 +32,18 @@
 #ifndef __PCOPY_UTIL_H__
 #define __PCOPY_UTIL_H__
 
-// size_t
+// bool
+#include <stdbool.h>
+// dev_t, off_t, size_t
 #include <sys/types.h>
 
-struct dirent;
 struct worker;
 
-int util_basic_filter(const struct dirent * file);
 void util_check_load_average(struct worker * worker, double limit);
+bool util_is_zero(const void * buffer, size_t length);
+bool util_device_queue(dev_t device, bool * rotational, unsigned int * nr_requests);
 unsigned int util_nb_cpus(void);
+bool util_parse_size(const char * string, off_t * size);
 size_t util_string_length(const char * string);
 size_t util_string_length2(const char * string, size_t length);
 void util_string_middle_elipsis(char * string, size_t length);
@@ -30,32 +30,48 @@
 \****************************************************************************/
 
 #define _GNU_SOURCE
-// alphasort, dirent
+// dirent64, DT_*
 #include <dirent.h>
-// mknod, open
+// errno
+#include <errno.h>
+// AT_*, mkdirat, mknodat, openat, posix_fadvise, sync_file_range
 #include <fcntl.h>
 // gettext
 #include <libintl.h>
-// pthread_mutex_lock, pthread_mutex_unlock
+// pthread_mutex_init, pthread_mutex_lock, pthread_mutex_unlock
 #include <pthread.h>
-// sem_init, sem_post, sem_wait
-#include <semaphore.h>
-// asprintf
+// va_end, va_start
+#include <stdarg.h>
+// asprintf, vasprintf
 #include <stdio.h>
-// calloc, free
+// calloc, free, malloc, qsort_r, realloc
 #include <stdlib.h>
-// strcmp, strdup, strlen, strrchr
+// strcmp, strcoll, strdup, strlen, strrchr
 #include <string.h>
-// fstat, chmod, lstat, mkdir, mkfifo, mknod, open
+// fchmodat, fstat, fstatat, lstat, mkdirat, mkfifoat, mknodat, statx
 #include <sys/stat.h>
-// fstat, lseek, lstat, mkdir, mkfifo, mknod, open
+// getrlimit, setrlimit
+#include <sys/resource.h>
+// SYS_getdents64
+#include <sys/syscall.h>
+// major, makedev, minor
+#include <sys/sysmacros.h>
+// fstat, fstatat, lseek, lstat, mkdirat, mkfifoat, mknodat, openat
 #include <sys/types.h>
-// access, chown, fchown, fstat, lseek, lstat, mknod, readlink, symlink
+// clock_gettime
+#include <time.h>
+// faccessat, fchown, fchownat, fstat, ftruncate, lseek, readlinkat,
+// symlinkat, syscall
 #include <unistd.h>
 
+#include "buffer.h"
 #include "checksum.h"
+#include "copy.h"
+#include "deque.h"
+#include "flush.h"
 #include "log.h"
 #include "option.h"
+#include "queue.h"
 #include "thread.h"
 #include "util.h"
 #include "worker.h"
@@ -65,21 +81,233 @@
 static char ** worker_inputs = NULL;
 static unsigned int worker_nb_inputs = 0;
 static const char * worker_output = NULL;
-static size_t worker_output_length = 0;
 
 static bool worker_running = false;
-static sem_t worker_jobs;
 static unsigned long worker_n_jobs = 0;
 
+// signaled when the last active job is recycled and when the process ends
+static pthread_mutex_t worker_done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_done_wait = PTHREAD_COND_INITIALIZER;
+static unsigned int worker_nb_active = 0;
+
+/**
+ * Producers take a free record, fill it without holding any lock and push
+ * it to the job queue. A fixed set of executors pops jobs, runs them and
+ * gives records back. Twice as many records as executors let producers
+ * prepare the next jobs while every executor is busy.
+ *
+ * Small files have their own lane, with its own records and executors, so
+ * that they keep going while big files occupy every executor of the other.
+ */
+struct worker_lane {
+	const char * name;
+
+	struct worker * records;
+	unsigned int nb_records;
+	unsigned int nb_executors;
+
+	struct queue * jobs;
+	struct queue * free_records;
+
+	/**
+	 * With --adaptive, only <limit> executors may take jobs at once, the
+	 * controller moves it between 1 and nb_executors
+	 */
+	bool adaptive;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned int limit;
+	unsigned int nb_active;
+	bool stopped;
+
+	// controller state
+	unsigned long last_bytes;
+	unsigned long last_files;
+	double last_rate;
+	unsigned int nb_holds;
+};
+
+#define WORKER_ADAPTIVE_SCALE 4
+
+enum {
+	worker_lane_large,
+	worker_lane_small,
+};
+
 static struct worker * workers = NULL;
 static unsigned int worker_nb_workers = 0;
-
-static pthread_mutex_t worker_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-
-static void worker_process_checksum(void * arg);
-static void worker_process_copy(void * arg);
+static struct worker_lane worker_lanes[2];
+static unsigned int worker_nb_lanes = 0;
+
+/**
+ * Jobs are grouped by source and destination devices. Each pair admits at
+ * most <limit> running jobs, the others wait in its own queue so that a
+ * slow disk does not hold every executor. Producers are blocked once
+ * <limit> jobs are already waiting, so that it does not hold every record
+ * either.
+ */
+struct worker_device {
+	dev_t src;
+	dev_t dest;
+	// 0 means no limit
+	unsigned int limit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned int nb_running;
+	struct deque * pending;
+
+	unsigned long nb_jobs;
+	unsigned long nb_delayed;
+};
+
+#define WORKER_MAX_DEVICES 64
+
+static struct worker_device * worker_devices[WORKER_MAX_DEVICES];
+static unsigned int worker_nb_devices = 0;
+static pthread_mutex_t worker_device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * An open source directory and its destination. Entries are reached with
+ * *at() calls relative to them, so the kernel only resolves one component
+ * and paths are not limited by PATH_MAX; full paths are only built for logs.
+ * References are held by the walker listing it, by the directories waiting
+ * to be listed inside it and by copy jobs of its files.
+ */
+struct worker_dir {
+	int fd_src;
+	int fd_dest;
+	dev_t dev_dest;
+
+	char * src_path;
+	char * dest_path;
+	size_t src_length;
+	size_t dest_length;
+
+	unsigned int nb_refs;
+};
+
+// inputs and output are given by the user, relative to the current directory
+static struct worker_dir worker_dir_root = {
+	.fd_src  = AT_FDCWD,
+	.fd_dest = AT_FDCWD,
+	.nb_refs = 1,
+};
+
+/**
+ * Directories are listed by several walkers. Each one pops directories from
+ * its own deque and steals from the others when it runs out of work.
+ */
+struct worker_walker {
+	unsigned int index;
+	struct deque * directories;
+	const struct pcopy_option * option;
+
+	// small files of the directory being listed, not submitted yet
+	struct worker * batch;
+
+	unsigned long nb_listed;
+	unsigned long nb_steals;
+};
+
+struct worker_walk_dir {
+	unsigned long job;
+	struct worker_dir * parent;
+	char * src_path;
+	char * dest_path;
+};
+
+/**
+ * Entries of a directory kept for sorting, names are stored one after
+ * another in a single pool
+ */
+struct worker_walk_entry {
+	unsigned long long inode;
+	size_t name;
+	unsigned char type;
+};
+
+static struct worker_walker * worker_walkers = NULL;
+static unsigned int worker_nb_walkers = 0;
+static unsigned int worker_nb_running_walkers = 0;
+
+static pthread_mutex_t worker_walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_walk_wait = PTHREAD_COND_INITIALIZER;
+static unsigned long worker_walk_pending = 0;
+static unsigned long worker_walk_generation = 0;
+static bool worker_walk_closed = false;
+static volatile bool worker_walk_failed = false;
+
+/**
+ * Small files are grouped by directory so that one job copies them back to
+ * back: one queue round trip, one executor wake-up and one reference on the
+ * directory for all of them. Each file keeps its own job number, log lines
+ * and digest.
+ */
+struct worker_batch {
+	unsigned int nb_files;
+	struct worker_batch_file {
+		unsigned long job;
+		char * src_file;
+		char * dest_file;
+		char * description;
+	} files[];
+};
+
+struct worker_split {
+	pthread_mutex_t lock;
+
+	struct checksum * checksum;
+	off_t size;
+	off_t chunk_size;
+
+	unsigned int nb_chunks;
+	unsigned int nb_done;
+	unsigned int nb_hashed;
+	bool * copied;
+	bool hashing;
+	bool failed;
+};
+
+static struct worker * worker_acquire(struct worker_lane * lane);
+static void worker_adapt(void * arg);
+static void worker_adapt_lane(struct worker_lane * lane, double elapsed);
+static int worker_batch_add(struct worker_walker * walker, struct worker_dir * parent, struct worker_device * device, unsigned long i_job, const char * src_path, const char * dest_path, const struct pcopy_option * option);
+static void worker_batch_submit(struct worker_walker * walker);
+static void worker_execute(void * arg);
+static bool worker_lane_init(struct worker_lane * lane, const char * name, struct worker * records, unsigned int nb_records, unsigned int nb_executors, unsigned int limit);
+static void worker_lane_stop(struct worker_lane * lane);
+static const char * worker_dir_name(size_t length, const char * path);
+static char * worker_dir_path(const char * path, const char * name);
+static struct worker_dir * worker_dir_ref(struct worker_dir * dir);
+static void worker_dir_unref(struct worker_dir * dir);
+static struct worker_device * worker_device_get(dev_t src, dev_t dest, const struct pcopy_option * option);
+static unsigned int worker_device_limit(dev_t device);
+static void worker_device_release(struct worker * worker);
+static void worker_drain(void);
+static struct checksum * worker_new_checksum(const struct pcopy_option * option, off_t size);
+static int worker_open(struct worker * worker, int dirfd, const char * name, const char * path, int flags, mode_t mode, bool * direct);
+static int worker_open_verify(struct worker * worker, int dirfd, const char * name, const char * path, bool * direct, bool * drop_cache);
+static void worker_process_batch(struct worker * worker);
+static void worker_process_checksum(struct worker * worker);
+static void worker_process_copy(struct worker * worker);
+static void worker_process_copy_chunk(struct worker * worker, int fd_in, int fd_out, bool direct, bool copied);
+static void worker_process_copy_finish(struct worker * worker, struct checksum * chck, int fd_in, int fd_out, off_t size, float pct_base);
 static void worker_process_do(void * arg);
-static int worker_process_do2(const char * partial_path, const char * full_path, const struct pcopy_option * option);
+static int worker_process_do2(struct worker_walker * walker, struct worker_dir * parent, const char * src_path, const char * dest_path, const struct stat * known_info, const struct pcopy_option * option);
+static bool worker_process_read_back(struct worker * worker, int fd, const char * filename, off_t size, bool direct, bool drop_cache, struct checksum * chck, float pct_base);
+static int worker_process_split(unsigned long i_job, struct worker_dir * parent, struct worker_device * device, const char * src_path, const char * dest_path, const struct stat * info, const struct pcopy_option * option);
+static void worker_recycle(struct worker * worker);
+static void worker_set_description(struct worker * worker, const char * format, ...) __attribute__ ((format (printf, 2, 3)));
+static void worker_set_finished(void);
+static void worker_split_free(struct worker_split * split);
+static void worker_submit(struct worker * worker, void (*process)(struct worker * worker));
+static void worker_walk(void * arg);
+static int worker_walk_compare(const void * a, const void * b, void * arg);
+static int worker_walk_entry(struct worker_walker * walker, struct worker_dir * dir, const char * name, unsigned char type);
+static int worker_walk_list(struct worker_walker * walker, struct worker_walk_dir * item);
+static struct worker_walk_dir * worker_walk_next(struct worker_walker * walker);
+static int worker_walk_push(struct worker_walker * walker, unsigned long i_job, struct worker_dir * parent, const char * src_path, const char * dest_path);
 
 
 bool worker_finished() {
@@ -87,8 +315,6 @@ bool worker_finished() {
 }
 
 struct worker * worker_get(unsigned int * nb_working_workers, unsigned int * nb_total_workers) {
-	pthread_mutex_lock(&worker_lock);
-
 	unsigned int i, nb_working = 0;
 	for (i = 0; i < worker_nb_workers; i++)
 		if (workers[i].status == worker_status_running)
@@ -102,23 +328,654 @@ struct worker * worker_get(unsigned int * nb_working_workers, unsigned int * nb_
 	return workers;
 }
 
+static void worker_set_description(struct worker * worker, const char * format, ...) {
+	char * description;
+
+	va_list va;
+	va_start(va, format);
+	int size = vasprintf(&description, format, va);
+	va_end(va);
+
+	if (size < 0)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+
+	char * old_description = worker->description;
+	worker->description = description;
+
+	pthread_mutex_unlock(&worker->lock);
+
+	free(old_description);
+}
+
+static void worker_set_finished() {
+	pthread_mutex_lock(&worker_done_lock);
+	worker_running = false;
+	pthread_cond_broadcast(&worker_done_wait);
+	pthread_mutex_unlock(&worker_done_lock);
+}
+
+static void worker_split_free(struct worker_split * split) {
+	if (split->checksum != NULL)
+		split->checksum->ops->free(split->checksum);
+
+	pthread_mutex_destroy(&split->lock);
+	free(split->copied);
+	free(split);
+}
+
+static void worker_submit(struct worker * worker, void (*process)(struct worker * worker)) {
+	worker->process = process;
+	worker->status = worker_status_queued;
+
+	struct worker_device * device = worker->device;
+	if (device != NULL && device->limit > 0) {
+		pthread_mutex_lock(&device->lock);
+
+		device->nb_jobs++;
+
+		while (deque_size(device->pending) >= device->limit)
+			pthread_cond_wait(&device->wait, &device->lock);
+
+		// the job is started by the one which frees a slot of the device
+		if (device->nb_running >= device->limit && deque_push(device->pending, worker)) {
+			device->nb_delayed++;
+			pthread_mutex_unlock(&device->lock);
+			return;
+		}
+
+		device->nb_running++;
+
+		pthread_mutex_unlock(&device->lock);
+	} else if (device != NULL)
+		__atomic_add_fetch(&device->nb_jobs, 1, __ATOMIC_RELAXED);
+
+	// blocks while the queue is full, executors are far behind
+	queue_push(worker->lane->jobs, worker);
+}
+
 void worker_process(char * inputs[], unsigned int nb_inputs, const char * output, struct pcopy_option * option) {
 	worker_inputs = inputs;
 	worker_nb_inputs = nb_inputs;
 	worker_output = output;
-	worker_output_length = strlen(worker_output);
 
-	thread_pool_run("main worker", worker_process_do, option);
+	// set before the main worker starts so that the display does not see it finished
+	worker_running = true;
+
+	if (thread_pool_run("main worker", worker_process_do, option) != 0)
+		worker_set_finished();
+}
+
+bool worker_wait(unsigned int timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&worker_done_lock);
+
+	int failed = 0;
+	while (worker_running && failed == 0)
+		failed = pthread_cond_timedwait(&worker_done_wait, &worker_done_lock, &deadline);
+
+	bool finished = !worker_running;
+
+	pthread_mutex_unlock(&worker_done_lock);
+
+	return finished;
+}
+
+static struct worker * worker_acquire(struct worker_lane * lane) {
+	// blocks while every record of the lane is queued or running
+	struct worker * worker = queue_pop(lane->free_records);
+	__atomic_add_fetch(&worker_nb_active, 1, __ATOMIC_RELAXED);
+
+	worker->process = NULL;
+	worker->src_file = worker->dest_file = worker->digest = NULL;
+	worker->description = NULL;
+	worker->dir = NULL;
+	worker->src_name = worker->dest_name = NULL;
+	worker->split = NULL;
+	worker->chunk = 0;
+	worker->batch = NULL;
+	worker->device = NULL;
+
+	return worker;
+}
+
+static void worker_adapt(void * arg) {
+	const struct pcopy_option * option = arg;
+
+	struct timespec last;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	pthread_mutex_lock(&worker_done_lock);
+
+	while (worker_running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		long long nsec = deadline.tv_nsec + (long long) (option->adaptive * 1e9);
+		deadline.tv_sec += nsec / 1000000000LL;
+		deadline.tv_nsec = nsec % 1000000000LL;
+
+		// this condition is also signaled when a phase ends
+		int failed = 0;
+		while (worker_running && failed == 0)
+			failed = pthread_cond_timedwait(&worker_done_wait, &worker_done_lock, &deadline);
+
+		if (!worker_running)
+			break;
+
+		pthread_mutex_unlock(&worker_done_lock);
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double elapsed = now.tv_sec - last.tv_sec + (now.tv_nsec - last.tv_nsec) / 1e9;
+		last = now;
+
+		unsigned int i;
+		for (i = 0; i < worker_nb_lanes; i++)
+			if (worker_lanes[i].adaptive)
+				worker_adapt_lane(worker_lanes + i, elapsed);
+
+		pthread_mutex_lock(&worker_done_lock);
+	}
+
+	pthread_mutex_unlock(&worker_done_lock);
+}
+
+/**
+ * Additive increase, multiplicative decrease: one more executor while the
+ * throughput grows, a quarter less as soon as it falls. When it is flat,
+ * the limit is kept but one more executor is tried now and then in case
+ * the workload has changed.
+ */
+static void worker_adapt_lane(struct worker_lane * lane, double elapsed) {
+	unsigned long nb_bytes = 0, nb_files = 0;
+	unsigned int i;
+	for (i = 0; i < lane->nb_records; i++) {
+		nb_bytes += lane->records[i].nb_bytes;
+		nb_files += lane->records[i].nb_files;
+	}
+
+	double bytes_rate = (nb_bytes - lane->last_bytes) / elapsed;
+	double files_rate = (nb_files - lane->last_files) / elapsed;
+	lane->last_bytes = nb_bytes;
+	lane->last_files = nb_files;
+
+	// nothing copied, e.g. while walkers list directories
+	if (bytes_rate == 0 && files_rate == 0)
+		return;
+
+	// small files are bound by their number, big ones by their size
+	double rate = lane == worker_lanes + worker_lane_small ? files_rate : bytes_rate;
+
+	pthread_mutex_lock(&lane->lock);
+
+	if (lane->stopped) {
+		pthread_mutex_unlock(&lane->lock);
+		return;
+	}
+
+	unsigned int old_limit = lane->limit, new_limit = old_limit;
+	const char * reason;
+
+	if (lane->last_rate == 0) {
+		reason = gettext("first sample");
+		new_limit = old_limit + 1;
+	} else if (rate >= lane->last_rate * 1.05) {
+		reason = gettext("throughput rose");
+		new_limit = old_limit + 1;
+		lane->nb_holds = 0;
+	} else if (rate <= lane->last_rate * 0.9) {
+		reason = gettext("throughput fell");
+		new_limit = old_limit * 3 / 4;
+		if (new_limit == old_limit)
+			new_limit--;
+		lane->nb_holds = 0;
+	} else if (++lane->nb_holds >= 5) {
+		reason = gettext("throughput is flat, probe");
+		new_limit = old_limit + 1;
+		lane->nb_holds = 0;
+	} else
+		reason = gettext("throughput is flat");
+
+	if (new_limit < 1)
+		new_limit = 1;
+	if (new_limit > lane->nb_executors)
+		new_limit = lane->nb_executors;
+
+	lane->limit = new_limit;
+	if (new_limit > old_limit)
+		pthread_cond_broadcast(&lane->wait);
+
+	pthread_mutex_unlock(&lane->lock);
+
+	log_write(gettext("%s lane: %.1f MB/s, %.1f files/s with %u workers (previous: %.1f), %s, %s %u workers"), lane->name, bytes_rate / 1048576, files_rate, old_limit, lane == worker_lanes + worker_lane_small ? lane->last_rate : lane->last_rate / 1048576, reason, new_limit > old_limit ? gettext("raise to") : new_limit < old_limit ? gettext("lower to") : gettext("keep"), new_limit);
+
+	lane->last_rate = rate;
+}
+
+static int worker_batch_add(struct worker_walker * walker, struct worker_dir * parent, struct worker_device * device, unsigned long i_job, const char * src_path, const char * dest_path, const struct pcopy_option * option) {
+	if (walker->batch != NULL && (walker->batch->dir != parent || walker->batch->device != device))
+		worker_batch_submit(walker);
+
+	struct worker * worker = walker->batch;
+	if (worker == NULL) {
+		struct worker_batch * batch = malloc(sizeof(struct worker_batch) + option->group_files * sizeof(struct worker_batch_file));
+		if (batch == NULL)
+			return -2;
+		batch->nb_files = 0;
+
+		worker = walker->batch = worker_acquire(worker_lanes + worker_lane_small);
+		worker->job = i_job;
+		worker->dir = worker_dir_ref(parent);
+		worker->device = device;
+		worker->batch = batch;
+		worker->pct = 0;
+		worker->option = option;
+	}
+
+	struct worker_batch_file * file = worker->batch->files + worker->batch->nb_files;
+	file->job = i_job;
+	file->src_file = strdup(src_path);
+	file->dest_file = strdup(dest_path);
+
+	int size = asprintf(&file->description, gettext("copy from '%s' to '%s'"), src_path, dest_path);
+	if (size < 0)
+		file->description = NULL;
+
+	if (size < 0 || file->src_file == NULL || file->dest_file == NULL) {
+		free(file->src_file);
+		free(file->dest_file);
+		free(file->description);
+		worker_batch_submit(walker);
+		return -2;
+	}
+
+	worker->batch->nb_files++;
+	if (worker->batch->nb_files == option->group_files)
+		worker_batch_submit(walker);
+
+	return 0;
+}
+
+static void worker_batch_submit(struct worker_walker * walker) {
+	struct worker * worker = walker->batch;
+	if (worker == NULL)
+		return;
+
+	walker->batch = NULL;
+
+	struct worker_batch * batch = worker->batch;
+	if (batch->nb_files > 1) {
+		worker_submit(worker, worker_process_batch);
+		return;
+	}
+
+	// a lone file is copied by a plain job
+	worker->batch = NULL;
+
+	if (batch->nb_files == 0) {
+		free(batch);
+		worker_recycle(worker);
+		return;
+	}
+
+	worker->job = batch->files[0].job;
+	worker->src_file = batch->files[0].src_file;
+	worker->dest_file = batch->files[0].dest_file;
+	worker->description = batch->files[0].description;
+	worker->src_name = worker_dir_name(worker->dir->src_length, worker->src_file);
+	worker->dest_name = worker_dir_name(worker->dir->dest_length, worker->dest_file);
+	free(batch);
+
+	worker_submit(worker, worker_process_copy);
+}
+
+static const char * worker_dir_name(size_t length, const char * path) {
+	return length > 0 ? path + length + 1 : path;
+}
+
+static char * worker_dir_path(const char * path, const char * name) {
+	if (path == NULL)
+		return strdup(name);
+
+	char * full_path;
+	if (asprintf(&full_path, "%s/%s", path, name) < 0)
+		return NULL;
+
+	return full_path;
+}
+
+static struct worker_dir * worker_dir_ref(struct worker_dir * dir) {
+	__atomic_add_fetch(&dir->nb_refs, 1, __ATOMIC_RELAXED);
+	return dir;
+}
+
+static void worker_dir_unref(struct worker_dir * dir) {
+	if (dir == NULL || dir == &worker_dir_root)
+		return;
+
+	if (__atomic_sub_fetch(&dir->nb_refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	close(dir->fd_src);
+	close(dir->fd_dest);
+	free(dir->src_path);
+	free(dir->dest_path);
+	free(dir);
+}
+
+static struct worker_device * worker_device_get(dev_t src, dev_t dest, const struct pcopy_option * option) {
+	unsigned int i, nb_devices = __atomic_load_n(&worker_nb_devices, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nb_devices; i++)
+		if (worker_devices[i]->src == src && worker_devices[i]->dest == dest)
+			return worker_devices[i];
+
+	pthread_mutex_lock(&worker_device_lock);
+
+	// another walker may have added it meanwhile
+	for (i = 0; i < worker_nb_devices; i++)
+		if (worker_devices[i]->src == src && worker_devices[i]->dest == dest) {
+			pthread_mutex_unlock(&worker_device_lock);
+			return worker_devices[i];
+		}
+
+	struct worker_device * device = NULL;
+	if (worker_nb_devices < WORKER_MAX_DEVICES)
+		device = malloc(sizeof(struct worker_device));
+
+	if (device == NULL) {
+		pthread_mutex_unlock(&worker_device_lock);
+		return NULL;
+	}
+
+	device->src = src;
+	device->dest = dest;
+	device->limit = option->nb_device_jobs;
+	device->pending = deque_new();
+	device->nb_running = 0;
+	device->nb_jobs = device->nb_delayed = 0;
+	pthread_mutex_init(&device->lock, NULL);
+	pthread_cond_init(&device->wait, NULL);
+
+	if (device->limit == 0) {
+		unsigned int limit_src = worker_device_limit(src);
+		unsigned int limit_dest = worker_device_limit(dest);
+
+		device->limit = limit_src;
+		if (limit_dest > 0 && (limit_src == 0 || limit_dest < limit_src))
+			device->limit = limit_dest;
+	}
+
+	// without its queue, jobs are not delayed
+	if (device->pending == NULL)
+		device->limit = 0;
+
+	worker_devices[worker_nb_devices] = device;
+	__atomic_store_n(&worker_nb_devices, worker_nb_devices + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&worker_device_lock);
+
+	if (device->limit > 0)
+		log_write(gettext("copy from device %u:%u to device %u:%u with at most %u jobs"), major(src), minor(src), major(dest), minor(dest), device->limit);
+	else
+		log_write(gettext("copy from device %u:%u to device %u:%u without limit"), major(src), minor(src), major(dest), minor(dest));
+
+	return device;
+}
+
+static unsigned int worker_device_limit(dev_t device) {
+	bool rotational;
+	unsigned int nr_requests;
+	if (!util_device_queue(device, &rotational, &nr_requests))
+		return 0;
+
+	// more streams than that make a disk seek between them
+	if (rotational)
+		return 2;
+
+	// leave room in the request queue for read-ahead and writeback of each job
+	unsigned int limit = nr_requests / 4;
+	return limit > 4 ? limit : 4;
+}
+
+static void worker_device_release(struct worker * worker) {
+	struct worker_device * device = worker->device;
+	if (device == NULL || device->limit == 0)
+		return;
+
+	pthread_mutex_lock(&device->lock);
+
+	// the slot goes to the oldest job waiting for the device
+	struct worker * next = deque_steal(device->pending);
+	if (next != NULL)
+		pthread_cond_signal(&device->wait);
+	else
+		device->nb_running--;
+
+	pthread_mutex_unlock(&device->lock);
+
+	if (next != NULL)
+		queue_push(next->lane->jobs, next);
+}
+
+static void worker_drain() {
+	pthread_mutex_lock(&worker_done_lock);
+	while (__atomic_load_n(&worker_nb_active, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait(&worker_done_wait, &worker_done_lock);
+	pthread_mutex_unlock(&worker_done_lock);
+}
+
+static void worker_execute(void * arg) {
+	struct worker_lane * lane = arg;
+
+	for (;;) {
+		if (lane->adaptive) {
+			pthread_mutex_lock(&lane->lock);
+			while (lane->nb_active >= lane->limit && !lane->stopped)
+				pthread_cond_wait(&lane->wait, &lane->lock);
+			lane->nb_active++;
+			pthread_mutex_unlock(&lane->lock);
+		}
+
+		struct worker * worker = queue_pop(lane->jobs);
+		if (worker == NULL)
+			break;
+
+		pthread_mutex_lock(&worker->lock);
+		worker->status = worker_status_running;
+		pthread_mutex_unlock(&worker->lock);
+
+		worker->process(worker);
+
+		worker_device_release(worker);
+		worker_recycle(worker);
+
+		if (lane->adaptive) {
+			pthread_mutex_lock(&lane->lock);
+			lane->nb_active--;
+			pthread_cond_signal(&lane->wait);
+			pthread_mutex_unlock(&lane->lock);
+		}
+	}
+}
+
+static bool worker_lane_init(struct worker_lane * lane, const char * name, struct worker * records, unsigned int nb_records, unsigned int nb_executors, unsigned int limit) {
+	lane->name = name;
+	lane->records = records;
+	lane->nb_records = nb_records;
+	lane->nb_executors = 0;
+
+	lane->adaptive = limit < nb_executors;
+	pthread_mutex_init(&lane->lock, NULL);
+	pthread_cond_init(&lane->wait, NULL);
+	lane->limit = limit;
+	lane->nb_active = 0;
+	lane->stopped = false;
+	lane->last_bytes = lane->last_files = 0;
+	lane->last_rate = 0;
+	lane->nb_holds = 0;
+	lane->jobs = queue_new(lane->nb_records + nb_executors);
+	lane->free_records = queue_new(lane->nb_records);
+
+	if (lane->jobs == NULL || lane->free_records == NULL) {
+		log_write(gettext("! error fatal, not enough memory to allocate jobs"));
+		queue_free(lane->jobs);
+		queue_free(lane->free_records);
+		return false;
+	}
+
+	unsigned int i;
+	for (i = 0; i < lane->nb_records; i++) {
+		pthread_mutex_init(&records[i].lock, NULL);
+		records[i].lane = lane;
+		queue_push(lane->free_records, records + i);
+	}
+
+	for (i = 0; i < nb_executors; i++) {
+		char * th_name;
+		int size = asprintf(&th_name, "%s #%u", name, i);
+
+		if (size >= 0 && thread_pool_run(th_name, worker_execute, lane) == 0)
+			lane->nb_executors++;
+		else
+			log_write(gettext("! warning, failed to start %s #%u"), name, i);
+
+		if (size >= 0)
+			free(th_name);
+	}
+
+	if (lane->limit > lane->nb_executors)
+		lane->limit = lane->nb_executors;
+
+	return lane->nb_executors > 0;
+}
+
+static void worker_lane_stop(struct worker_lane * lane) {
+	// executors held back by the controller have to reach their null job
+	pthread_mutex_lock(&lane->lock);
+	lane->stopped = true;
+	pthread_cond_broadcast(&lane->wait);
+	pthread_mutex_unlock(&lane->lock);
+
+	// a null job stops one executor
+	unsigned int i;
+	for (i = 0; i < lane->nb_executors; i++)
+		queue_push(lane->jobs, NULL);
+
+	// producers wait for free records, executors wait for jobs
+	struct queue_stats jobs, records;
+	queue_get_stats(lane->jobs, &jobs);
+	queue_get_stats(lane->free_records, &records);
+	log_write(gettext("%s lane: %lu jobs run by %u workers, %lu retries, producers waited %lu times (%.3fs), workers waited %lu times (%.3fs)"), lane->name, jobs.nb_pushed - lane->nb_executors, lane->nb_executors, jobs.nb_retries + records.nb_retries, records.nb_pop_waits, records.pop_wait, jobs.nb_pop_waits, jobs.pop_wait);
+}
+
+static struct checksum * worker_new_checksum(const struct pcopy_option * option, off_t size) {
+	struct checksum * chck = checksum_get_default()->new_checksum();
+	if (chck == NULL)
+		return NULL;
+
+	// handing buffers over to a hasher is only worth it when a file spans several of them
+	if (option->pipeline_depth > 0 && size > 2 * BUFFER_SIZE) {
+		struct checksum * pipeline = checksum_pipeline_new(chck, option->pipeline_depth);
+		if (pipeline != NULL)
+			chck = pipeline;
+	}
+
+	return chck;
+}
+
+static int worker_open(struct worker * worker, int dirfd, const char * name, const char * path, int flags, mode_t mode, bool * direct) {
+	*direct = false;
+
+	if (worker->option->direct_io) {
+		int fd = openat(dirfd, name, flags | O_DIRECT, mode);
+		if (fd >= 0) {
+			*direct = true;
+			return fd;
+		}
+
+		if (errno != EINVAL)
+			return fd;
+
+		log_write(gettext("#%lu ! warning, direct I/O is not supported for '%s', use buffered I/O instead"), worker->job, path);
+	}
+
+	return openat(dirfd, name, flags, mode);
+}
+
+static int worker_open_verify(struct worker * worker, int dirfd, const char * name, const char * path, bool * direct, bool * drop_cache) {
+	*drop_cache = worker->option->verify == pcopy_verify_drop_cache;
+
+	if (worker->option->verify == pcopy_verify_direct) {
+		int fd = openat(dirfd, name, O_RDONLY | O_DIRECT);
+		if (fd >= 0) {
+			*direct = true;
+			return fd;
+		}
+
+		if (errno != EINVAL)
+			return fd;
+
+		log_write(gettext("#%lu ! warning, direct I/O is not supported for verifying '%s', drop its cached pages instead"), worker->job, path);
+		*drop_cache = true;
+	}
+
+	return worker_open(worker, dirfd, name, path, O_RDONLY, 0, direct);
 }
 
-static void worker_process_checksum(void * arg) {
-	struct worker * worker = arg;
+static void worker_process_batch(struct worker * worker) {
+	struct worker_batch * batch = worker->batch;
+
+	log_write(gettext("#%lu @ copy %u small files in one job"), worker->job, batch->nb_files);
+
+	unsigned int i;
+	for (i = 0; i < batch->nb_files; i++) {
+		struct worker_batch_file * file = batch->files + i;
+
+		// strings of the previous file may be read by the display
+		pthread_mutex_lock(&worker->lock);
+
+		char * src_file = worker->src_file, * dest_file = worker->dest_file;
+		char * description = worker->description;
 
+		worker->job = file->job;
+		worker->src_file = file->src_file;
+		worker->dest_file = file->dest_file;
+		worker->description = file->description;
+		worker->pct = 0;
+
+		pthread_mutex_unlock(&worker->lock);
+
+		free(src_file);
+		free(dest_file);
+		free(description);
+
+		worker->src_name = worker_dir_name(worker->dir->src_length, worker->src_file);
+		worker->dest_name = worker_dir_name(worker->dir->dest_length, worker->dest_file);
+
+		worker_process_copy(worker);
+	}
+
+	// strings of the last file are released with the record
+	free(batch);
+	worker->batch = NULL;
+}
+
+static void worker_process_checksum(struct worker * worker) {
 	struct checksum_driver * chck_dr = checksum_get_default();
 
 	log_write(gettext("#%lu # recompute %s of '%s'"), worker->job, chck_dr->name, worker->src_file);
 
-	int fd_in = open(worker->src_file, O_RDONLY);
+	bool direct, drop_cache;
+	int fd_in = worker_open_verify(worker, AT_FDCWD, worker->src_file, worker->src_file, &direct, &drop_cache);
 	if (fd_in < 0) {
 		log_write(gettext("#%lu ! error fatal, failed to open '%s' for reading because %m"), worker->job, worker->src_file);
 		goto checksum_finished;
@@ -131,23 +988,14 @@ static void worker_process_checksum(void * arg) {
 		goto checksum_finished;
 	}
 
-	struct checksum * chck = chck_dr->new_checksum();
-
-	char buffer[16384];
-	ssize_t nb_read, nb_total_read = 0;
-	while (nb_read = read(fd_in, buffer, 16384), nb_read > 0) {
-		chck->ops->update(chck, buffer, nb_read);
-
-		nb_total_read += nb_read;
-
-		float done = nb_total_read;
-		worker->pct = done / info.st_size;
-
-		util_check_load_average(worker, worker->option->load_average);
+	struct checksum * chck = worker_new_checksum(worker->option, info.st_size);
+	if (chck == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), worker->job, worker->src_file);
+		close(fd_in);
+		goto checksum_finished;
 	}
 
-	if (nb_read < 0)
-		log_write(gettext("#%lu ! error fatal, error while reading from '%s' because %m"), worker->job, worker->src_file);
+	worker_process_read_back(worker, fd_in, worker->src_file, info.st_size, direct, drop_cache, chck, 0);
 
 	close(fd_in);
 
@@ -162,24 +1010,25 @@ static void worker_process_checksum(void * arg) {
 	free(computed);
 
 checksum_finished:
-	worker->status = worker_status_finished;
-
-	pthread_mutex_lock(&worker_lock);
-	pthread_mutex_unlock(&worker_lock);
-	sem_post(&worker_jobs);
+	return;
 }
 
-static void worker_process_copy(void * arg) {
-	struct worker * worker = arg;
+static void worker_process_copy(struct worker * worker) {
+	struct worker_split * split = worker->split;
 
-	log_write(gettext("#%lu @ copy regular file from '%s' to '%s'"), worker->job, worker->src_file, worker->dest_file);
+	if (split == NULL)
+		log_write(gettext("#%lu @ copy regular file from '%s' to '%s'"), worker->job, worker->src_file, worker->dest_file);
+	else
+		log_write(gettext("#%lu @ copy chunk %u/%u from '%s' to '%s'"), worker->job, worker->chunk + 1, split->nb_chunks, worker->src_file, worker->dest_file);
 
-	struct checksum_driver * chck_dr = checksum_get_default();
 	bool differ_checksum = checksum_has_checksum_file();
 
-	int fd_in = open(worker->src_file, O_RDONLY);
+	bool direct_in, direct_out;
+	int fd_in = worker_open(worker, worker->dir->fd_src, worker->src_name, worker->src_file, O_RDONLY, 0, &direct_in);
 	if (fd_in < 0) {
 		log_write(gettext("#%lu ! error fatal, failed to open '%s' for reading because %m"), worker->job, worker->src_file);
+		if (split != NULL)
+			worker_process_copy_chunk(worker, -1, -1, false, false);
 		goto copy_finished;
 	}
 
@@ -187,44 +1036,160 @@ static void worker_process_copy(void * arg) {
 	if (fstat(fd_in, &info) != 0) {
 		log_write(gettext("#%lu ! error fatal, failed to get information of '%s' because %m"), worker->job, worker->src_file);
 		close(fd_in);
+		if (split != NULL)
+			worker_process_copy_chunk(worker, -1, -1, false, false);
 		goto copy_finished;
 	}
 
-	int fd_out = open(worker->dest_file, O_RDWR | O_CREAT | O_TRUNC, info.st_mode);
+	// destination of a split file has already been created
+	int flags = split != NULL ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC;
+	int fd_out = worker_open(worker, worker->dir->fd_dest, worker->dest_name, worker->dest_file, flags, info.st_mode, &direct_out);
 	if (fd_out < 0) {
 		log_write(gettext("#%lu ! error fatal, failed to open '%s' for writing because %m"), worker->job, worker->dest_file);
 		close(fd_in);
+		if (split != NULL)
+			worker_process_copy_chunk(worker, -1, -1, false, false);
+		goto copy_finished;
+	}
+
+	if (split != NULL) {
+		off_t offset = split->chunk_size * worker->chunk;
+
+		struct copy_file file = {
+			.worker   = worker,
+			.fd_in    = fd_in,
+			.fd_out   = fd_out,
+			.offset   = offset,
+			.size     = split->size - offset < split->chunk_size ? split->size - offset : split->chunk_size,
+			.direct   = direct_in || direct_out,
+			// the first chunk feeds the digest while being copied
+			.checksum = worker->chunk == 0 ? split->checksum : NULL,
+			.ratio    = 1,
+		};
+
+		bool ok = copy_data(&file);
+		worker_process_copy_chunk(worker, fd_in, fd_out, direct_in || direct_out, ok);
 		goto copy_finished;
 	}
 
 	if (fchown(fd_out, info.st_uid, info.st_gid) != 0)
 		log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), worker->job, worker->dest_file);
 
-	struct checksum * chck = chck_dr->new_checksum();
+	struct checksum * chck = worker_new_checksum(worker->option, info.st_size);
+	if (chck == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), worker->job, worker->src_file);
+		close(fd_in);
+		close(fd_out);
+		goto copy_finished;
+	}
 
-	char buffer[16384];
-	ssize_t nb_read, nb_total_read = 0;
-	while (nb_read = read(fd_in, buffer, 16384), nb_read > 0) {
-		ssize_t nb_write = write(fd_out, buffer, nb_read);
-		if (nb_write < 0) {
-			log_write(gettext("#%lu ! error fatal, error while writing to '%s' because %m"), worker->job, worker->dest_file);
-			close(fd_in);
-			close(fd_out);
-			goto copy_finished;
+	struct copy_file file = {
+		.worker   = worker,
+		.fd_in    = fd_in,
+		.fd_out   = fd_out,
+		.offset   = 0,
+		.size     = info.st_size,
+		.direct   = direct_in || direct_out,
+		.checksum = chck,
+		.ratio    = differ_checksum ? 1 : 0.5,
+	};
+
+	if (!copy_data(&file)) {
+		chck->ops->free(chck);
+		close(fd_in);
+		close(fd_out);
+		goto copy_finished;
+	}
+
+	worker_process_copy_finish(worker, chck, fd_in, fd_out, info.st_size, 0.5);
+
+	// directory is released with the record, a batch still needs it
+copy_finished:
+	worker->nb_files++;
+}
+
+/**
+ * Chunks are copied in any order but the digest of the file has to be
+ * computed in order. The first chunk is hashed while being copied, then the
+ * job which completes the chunk following the last hashed one reads it back
+ * and carries on with the next completed chunks. The job which hashes the last
+ * chunk flushes and verifies the whole file.
+ */
+static void worker_process_copy_chunk(struct worker * worker, int fd_in, int fd_out, bool direct, bool copied) {
+	struct worker_split * split = worker->split;
+
+	pthread_mutex_lock(&split->lock);
+
+	if (copied)
+		split->copied[worker->chunk] = true;
+	else
+		split->failed = true;
+	split->nb_done++;
+
+	while (!split->failed && !split->hashing && split->nb_hashed < split->nb_chunks && split->copied[split->nb_hashed]) {
+		unsigned int chunk = split->nb_hashed;
+		split->hashing = true;
+
+		pthread_mutex_unlock(&split->lock);
+
+		bool hashed = true;
+		if (chunk > 0) {
+			worker_set_description(worker, gettext("compute digest of chunk %u/%u of '%s'"), chunk + 1, split->nb_chunks, worker->src_file);
+
+			off_t offset = split->chunk_size * chunk;
+			struct copy_file file = {
+				.worker   = worker,
+				.fd_in    = fd_in,
+				.fd_out   = fd_out,
+				.offset   = offset,
+				.size     = split->size - offset < split->chunk_size ? split->size - offset : split->chunk_size,
+				.direct   = direct,
+				.checksum = split->checksum,
+				.ratio    = 1,
+			};
+
+			char * buffer = buffer_get();
+			if (buffer != NULL) {
+				hashed = copy_hash_range(&file, file.offset, file.offset + file.size, &buffer);
+				buffer_release(buffer);
+			} else {
+				log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), worker->job, worker->src_file);
+				hashed = false;
+			}
 		}
 
-		nb_total_read += nb_read;
+		pthread_mutex_lock(&split->lock);
+
+		split->hashing = false;
+		if (hashed)
+			split->nb_hashed++;
+		else
+			split->failed = true;
+	}
 
-		float done = nb_total_read;
-		if (!differ_checksum)
-			done /= 2;
-		worker->pct = done / info.st_size;
+	bool finish = !split->failed && split->nb_hashed == split->nb_chunks;
+	bool release = finish || (split->failed && !split->hashing && split->nb_done == split->nb_chunks);
 
-		chck->ops->update(chck, buffer, nb_read);
+	pthread_mutex_unlock(&split->lock);
 
-		util_check_load_average(worker, worker->option->load_average);
+	if (finish) {
+		worker_process_copy_finish(worker, split->checksum, fd_in, fd_out, split->size, 0);
+		split->checksum = NULL;
+	} else {
+		if (fd_in > -1)
+			close(fd_in);
+		if (fd_out > -1)
+			close(fd_out);
 	}
 
+	if (release)
+		worker_split_free(split);
+}
+
+static void worker_process_copy_finish(struct worker * worker, struct checksum * chck, int fd_in, int fd_out, off_t size, float pct_base) {
+	struct checksum_driver * chck_dr = checksum_get_default();
+	bool differ_checksum = checksum_has_checksum_file();
+
 	char * computed = chck->ops->digest(chck);
 	log_write(gettext("#%lu # %s's sum of '%s' is %s"), worker->job, chck_dr->name, worker->src_file, computed);
 	chck->ops->free(chck);
@@ -232,148 +1197,216 @@ static void worker_process_copy(void * arg) {
 	if (differ_checksum)
 		checksum_add(computed, worker->dest_file);
 
-	if (nb_read < 0) {
-		log_write(gettext("#%lu ! error fatal, error while reading from '%s' because %m"), worker->job, worker->src_file);
-		close(fd_in);
-		close(fd_out);
-		goto copy_finished;
-	}
-
-	pthread_mutex_lock(&worker_lock);
-
-	char * old_description = worker->description;
-	int size = asprintf(&worker->description, gettext("flushing data of '%s'"), worker->dest_file);
-	if (size > 0)
-		free(old_description);
-	else
-		worker->description = old_description;
-
-	pthread_mutex_unlock(&worker_lock);
+	worker_set_description(worker, gettext("flushing data of '%s'"), worker->dest_file);
 
-	log_write(gettext("#%lu > flushing file '%s'"), worker->job, worker->dest_file);
-	if (fsync(fd_out) != 0) {
-		log_write(gettext("#%lu ! error while flushing file from '%s' because %m"), worker->job, worker->dest_file);
+	if (!flush_add(worker->job, fd_out, worker->dest_file)) {
+		free(computed);
 		close(fd_in);
 		close(fd_out);
-		goto copy_finished;
+		return;
 	}
 
 	close(fd_in);
+	close(fd_out);
 
 	if (differ_checksum) {
-		close(fd_out);
-		goto copy_finished;
+		free(computed);
+		return;
 	}
 
-	off_t begin = lseek(fd_out, 0, SEEK_SET);
-	if (begin == (off_t) -1) {
-		log_write(gettext("#%lu ! error while repositioning file '%s' at it beginning"), worker->job, worker->dest_file);
-		close(fd_out);
-		goto copy_finished;
+	/**
+	 * Verification reopens the destination so that its read-ahead state and
+	 * O_DIRECT flag do not depend on how data has been written.
+	 */
+	bool direct, drop_cache;
+	fd_out = worker_open_verify(worker, worker->dir->fd_dest, worker->dest_name, worker->dest_file, &direct, &drop_cache);
+	if (fd_out < 0) {
+		log_write(gettext("#%lu ! error fatal, failed to open '%s' for verifying because %m"), worker->job, worker->dest_file);
+		free(computed);
+		return;
 	}
 
-	chck = chck_dr->new_checksum();
-	nb_total_read = 0;
-
-	while (nb_read = read(fd_out, buffer, 16384), nb_read > 0) {
-		chck->ops->update(chck, buffer, nb_read);
-
-		nb_total_read += nb_read;
-
-		float done = nb_total_read;
-		done /= 2;
-		worker->pct = 0.5 + done / info.st_size;
-
-		util_check_load_average(worker, worker->option->load_average);
+	chck = worker_new_checksum(worker->option, size);
+	if (chck == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), worker->job, worker->dest_file);
+		close(fd_out);
+		free(computed);
+		return;
 	}
 
-	if (nb_read < 0)
-		log_write(gettext("#%lu ! warning, error while reading from '%s' because %m"), worker->job, worker->dest_file);
+	worker_process_read_back(worker, fd_out, worker->dest_file, size, direct, drop_cache, chck, pct_base);
 
 	close(fd_out);
 
 	char * recomputed = chck->ops->digest(chck);
 	chck->ops->free(chck);
 
-	if (strcmp(computed, recomputed) == 0) {
+	if (strcmp(computed, recomputed) == 0)
 		log_write(gettext("#%lu = digests match (digest: %s) '%s'"), worker->job, computed, worker->src_file);
-
-		free(computed);
-		free(recomputed);
-	} else {
+	else
 		log_write(gettext("#%lu ≠ digests mismatch between '%s'[%s] and '%s'[%s]"), worker->job, worker->src_file, computed, worker->dest_file, recomputed);
 
-		free(computed);
-		free(recomputed);
-	}
-
-copy_finished:
-	worker->status = worker_status_finished;
-
-	pthread_mutex_lock(&worker_lock);
-	pthread_mutex_unlock(&worker_lock);
-	sem_post(&worker_jobs);
+	free(computed);
+	free(recomputed);
 }
 
 static void worker_process_do(void * arg) {
 	const struct pcopy_option * option = arg;
 
-	int nb_cpus = option->nb_jobs > 0 ? option->nb_jobs : util_nb_cpus();
-	sem_init(&worker_jobs, 0, nb_cpus);
+	unsigned int nb_cpus = option->nb_jobs > 0 ? option->nb_jobs : util_nb_cpus();
+	unsigned int nb_small_jobs = option->nb_small_jobs > 0 ? option->nb_small_jobs : 2 * util_nb_cpus();
+	if (option->small_size == 0)
+		nb_small_jobs = 0;
 
-	worker_running = true;
+	flush_setup(option);
 
 	log_write(gettext("Start pCopy %s (build: %s %s)"), PCOPY_VERSION, __DATE__, __TIME__);
 
-	workers = calloc(nb_cpus, sizeof(struct worker));
-	worker_nb_workers = nb_cpus;
+	// each directory being walked keeps two descriptors open
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		rlim_t old_limit = limit.rlim_cur;
+		limit.rlim_cur = limit.rlim_max;
+
+		if (setrlimit(RLIMIT_NOFILE, &limit) == 0)
+			log_write(gettext("raise limit of open files from %lu to %lu"), (unsigned long) old_limit, (unsigned long) limit.rlim_max);
+	}
+
+	// with --adaptive, more executors are started than allowed to run at first
+	unsigned int scale = option->adaptive > 0 ? WORKER_ADAPTIVE_SCALE : 1;
+
+	// each walker may hold one record of the small lane while it fills a batch
+	unsigned int nb_walkers = option->nb_walkers > 0 ? option->nb_walkers : 1;
+	unsigned int nb_small_records = nb_small_jobs > 0 ? 2 * scale * nb_small_jobs + nb_walkers : 0;
+
+	worker_nb_workers = 2 * scale * nb_cpus + nb_small_records;
+	workers = calloc(worker_nb_workers, sizeof(struct worker));
+	if (workers == NULL) {
+		log_write(gettext("! error fatal, not enough memory to allocate jobs"));
+		worker_set_finished();
+		return;
+	}
+
+	worker_nb_lanes = 0;
+	if (worker_lane_init(worker_lanes + worker_lane_large, "worker", workers, 2 * scale * nb_cpus, scale * nb_cpus, nb_cpus))
+		worker_nb_lanes++;
+
+	// without small lane, every file goes into the first one
+	if (worker_nb_lanes > 0 && nb_small_jobs > 0 && worker_lane_init(worker_lanes + worker_lane_small, "small", workers + 2 * scale * nb_cpus, nb_small_records, scale * nb_small_jobs, nb_small_jobs))
+		worker_nb_lanes++;
+
+	if (worker_nb_lanes == 0) {
+		log_write(gettext("! error fatal, failed to start any worker"));
+		worker_set_finished();
+		return;
+	}
+
+	if (worker_nb_lanes > 1)
+		log_write(gettext("files up to %lld bytes are copied by %u workers of their own"), (long long) option->small_size, worker_lanes[worker_lane_small].limit);
+
+	if (scale > 1 && thread_pool_run("controller", worker_adapt, (void *) option) != 0)
+		log_write(gettext("! warning, failed to start the controller of running jobs"));
 
 	unsigned int i;
+
+	worker_walkers = calloc(nb_walkers, sizeof(struct worker_walker));
+
+	for (i = 0; i < nb_walkers; i++) {
+		struct worker_walker * walker = worker_walkers + i;
+		walker->index = i;
+		walker->directories = deque_new();
+		walker->option = option;
+
+		if (walker->directories == NULL)
+			break;
+	}
+	worker_nb_walkers = worker_nb_running_walkers = i;
+
+	if (worker_nb_walkers == 0) {
+		log_write(gettext("! error fatal, not enough memory to walk through directories"));
+		free(worker_walkers);
+		worker_set_finished();
+		return;
+	}
+
+	// this thread is the first walker, the others are started now and wait for directories
+	for (i = 1; i < worker_nb_walkers; i++) {
+		char * name;
+		int size = asprintf(&name, "walker #%u", i);
+
+		if (size < 0 || thread_pool_run(name, worker_walk, worker_walkers + i) != 0) {
+			log_write(gettext("! warning, failed to start walker #%u"), i);
+
+			pthread_mutex_lock(&worker_walk_lock);
+			worker_nb_running_walkers--;
+			pthread_mutex_unlock(&worker_walk_lock);
+		}
+
+		if (size >= 0)
+			free(name);
+	}
+
+	struct stat output_info;
+	if (stat(worker_output, &output_info) == 0)
+		worker_dir_root.dev_dest = output_info.st_dev;
+
 	int failed = 0;
 	for (i = 0; i < worker_nb_inputs && failed == 0; i++) {
 		const char * inputs = worker_inputs[i];
 		char * src_input = strrchr(inputs, '/');
-		failed = worker_process_do2(src_input, inputs, option);
+
+		char * output = NULL;
+		if (asprintf(&output, "%s%s", worker_output, src_input) < 0) {
+			failed = -2;
+			break;
+		}
+
+		failed = worker_process_do2(worker_walkers, &worker_dir_root, inputs, output, NULL, option);
+		free(output);
 	}
 
-	int free_job = 0;
-	while (nb_cpus != free_job) {
-		sleep(1);
-		sem_getvalue(&worker_jobs, &free_job);
+	worker_batch_submit(worker_walkers);
+
+	pthread_mutex_lock(&worker_walk_lock);
+	if (failed != 0)
+		worker_walk_failed = true;
+	worker_walk_closed = true;
+	pthread_cond_broadcast(&worker_walk_wait);
+	pthread_mutex_unlock(&worker_walk_lock);
+
+	worker_walk(worker_walkers);
+
+	pthread_mutex_lock(&worker_walk_lock);
+	while (worker_nb_running_walkers > 0)
+		pthread_cond_wait(&worker_walk_wait, &worker_walk_lock);
+	pthread_mutex_unlock(&worker_walk_lock);
+
+	unsigned long nb_listed = 0, nb_steals = 0;
+	for (i = 0; i < worker_nb_walkers; i++) {
+		nb_listed += worker_walkers[i].nb_listed;
+		nb_steals += worker_walkers[i].nb_steals;
+		deque_free(worker_walkers[i].directories);
 	}
+	free(worker_walkers);
+	worker_walkers = NULL;
+
+	log_write(gettext("%u walkers listed %lu directories, %lu of them were stolen"), worker_nb_walkers, nb_listed, nb_steals);
+
+	worker_drain();
+
+	flush_finish();
 
 	if (checksum_has_checksum_file()) {
 		checksum_rewind();
 
 		char * digest = NULL, * filename = NULL;
 		while (checksum_parse(&digest, &filename)) {
-			unsigned long i_job = ++worker_n_jobs;
-
-			sem_wait(&worker_jobs);
-			pthread_mutex_lock(&worker_lock);
-
-			struct worker * worker = NULL;
-			unsigned int i;
-			for (i = 0; i < worker_nb_workers && worker == NULL; i++)
-				if (workers[i].status == worker_status_init)
-					worker = workers + i;
-
-			for (i = 0; i < worker_nb_workers && worker == NULL; i++)
-				if (workers[i].status == worker_status_finished) {
-					worker = workers + i;
-
-					free(worker->src_file);
-					free(worker->dest_file);
-					free(worker->digest);
-					free(worker->description);
-					worker->src_file = worker->dest_file = worker->digest = NULL;
-					worker->description = NULL;
-				}
+			unsigned long i_job = __atomic_add_fetch(&worker_n_jobs, 1, __ATOMIC_RELAXED);
 
+			struct worker * worker = worker_acquire(worker_lanes + worker_lane_large);
 			struct checksum_driver * chck_dr = checksum_get_default();
 
 			worker->job = i_job;
-			worker->status = worker_status_running;
 			worker->src_file = filename;
 			worker->dest_file = NULL;
 			worker->digest = digest;
@@ -381,138 +1414,110 @@ static void worker_process_do(void * arg) {
 			worker->pct = 0;
 			worker->option = option;
 
-			if (size < 0)
-				break;
-
-			pthread_mutex_unlock(&worker_lock);
-
-			char * name;
-			size = asprintf(&name, "worker #%lu", i_job);
-
-			if (size < 0)
+			if (size < 0) {
+				worker->description = NULL;
+				worker_recycle(worker);
 				break;
+			}
 
-			int error = thread_pool_run(name, worker_process_checksum, worker);
+			worker_submit(worker, worker_process_checksum);
+		}
 
-			if (error != 0)
-				log_write(gettext("#%lu ! error, failed to create new thread"), i_job);
+		worker_drain();
+	}
 
-			free(name);
-		}
+	for (i = 0; i < worker_nb_lanes; i++)
+		worker_lane_stop(worker_lanes + i);
 
-		free_job = 0;
-		while (nb_cpus != free_job) {
-			sleep(1);
-			sem_getvalue(&worker_jobs, &free_job);
-		}
+	for (i = 0; i < worker_nb_devices; i++) {
+		struct worker_device * device = worker_devices[i];
+		log_write(gettext("device %u:%u to device %u:%u: %lu jobs, %lu of them waited for the device"), major(device->src), minor(device->src), major(device->dest), minor(device->dest), device->nb_jobs, device->nb_delayed);
 	}
 
+	struct thread_pool_stats pool;
+	thread_pool_get_stats(&pool);
+	log_write(gettext("thread pool: %u threads, %lu tasks run, %lu of them were stolen, %lu still queued"), pool.nb_threads, pool.nb_run, pool.nb_steals, pool.nb_queued);
+
 	log_write(gettext("Process finished"));
 
-	worker_running = false;
+	worker_set_finished();
 }
 
-static int worker_process_do2(const char * partial_path, const char * full_path, const struct pcopy_option * option) {
-	unsigned long i_job = ++worker_n_jobs;
+static int worker_process_do2(struct worker_walker * walker, struct worker_dir * parent, const char * src_path, const char * dest_path, const struct stat * known_info, const struct pcopy_option * option) {
+	unsigned long i_job = __atomic_add_fetch(&worker_n_jobs, 1, __ATOMIC_RELAXED);
+
+	const char * src_name = worker_dir_name(parent->src_length, src_path);
+	const char * dest_name = worker_dir_name(parent->dest_length, dest_path);
 
+	// walkers give what they already know about the entry
 	struct stat info;
-	int error = lstat(full_path, &info), warning = 0;
+	int error = 0, warning = 0;
+	if (known_info != NULL)
+		info = *known_info;
+	else
+		error = fstatat(parent->fd_src, src_name, &info, AT_SYMLINK_NOFOLLOW);
+
 	if (error != 0) {
-		log_write(gettext("#%lu ! error fatal, failed to get information of '%s' because %m"), i_job, full_path);
+		log_write(gettext("#%lu ! error fatal, failed to get information of '%s' because %m"), i_job, src_path);
 		return 1;
 	}
 
-	char * output = NULL;
-	int size = asprintf(&output, "%s%s", worker_output, partial_path);
-	if (size < 0)
-		return -2;
-
 	if (S_ISBLK(info.st_mode)) {
-		log_write(gettext("#%lu ~ create block device '%s', major: %d, minor: %d"), i_job, output, (int) info.st_rdev >> 8, (int) info.st_rdev & 0xFF);
+		log_write(gettext("#%lu ~ create block device '%s', major: %d, minor: %d"), i_job, dest_path, (int) info.st_rdev >> 8, (int) info.st_rdev & 0xFF);
 
-		error = mknod(output, info.st_mode, info.st_rdev);
+		error = mknodat(parent->fd_dest, dest_name, info.st_mode, info.st_rdev);
 		if (error != 0)
-			log_write(gettext("#%lu ! error, failed to create block device '%s' because %m"), i_job, output);
+			log_write(gettext("#%lu ! error, failed to create block device '%s' because %m"), i_job, dest_path);
 		else {
-			warning = chown(output, info.st_uid, info.st_gid);
+			warning = fchownat(parent->fd_dest, dest_name, info.st_uid, info.st_gid, 0);
 			if (warning != 0)
-				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, dest_path);
 		}
 	} else if (S_ISCHR(info.st_mode)) {
-		log_write(gettext("#%lu ~ create character device '%s', major: %d, minor: %d"), i_job, output, (int) info.st_rdev >> 8, (int) info.st_rdev & 0xFF);
+		log_write(gettext("#%lu ~ create character device '%s', major: %d, minor: %d"), i_job, dest_path, (int) info.st_rdev >> 8, (int) info.st_rdev & 0xFF);
 
-		error = mknod(output, info.st_mode, info.st_rdev);
+		error = mknodat(parent->fd_dest, dest_name, info.st_mode, info.st_rdev);
 		if (error != 0)
-			log_write(gettext("#%lu ! error, failed to create character device '%s' because %m"), i_job, output);
+			log_write(gettext("#%lu ! error, failed to create character device '%s' because %m"), i_job, dest_path);
 		else {
-			warning = chown(output, info.st_uid, info.st_gid);
+			warning = fchownat(parent->fd_dest, dest_name, info.st_uid, info.st_gid, 0);
 			if (warning != 0)
-				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, dest_path);
 		}
 	} else if (S_ISDIR(info.st_mode)) {
-		if (access(output, F_OK) != 0) {
-			log_write(gettext("#%lu ~ create directory '%s'"), i_job, output);
+		if (faccessat(parent->fd_dest, dest_name, F_OK, 0) != 0) {
+			log_write(gettext("#%lu ~ create directory '%s'"), i_job, dest_path);
 
-			error = mkdir(output, info.st_mode);
+			error = mkdirat(parent->fd_dest, dest_name, info.st_mode);
 			if (error != 0)
-				log_write(gettext("#%lu ! error, failed to create directory '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! error, failed to create directory '%s' because %m"), i_job, dest_path);
 			else {
-				warning = chown(output, info.st_uid, info.st_gid);
+				warning = fchownat(parent->fd_dest, dest_name, info.st_uid, info.st_gid, 0);
 				if (warning != 0)
-					log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, output);
+					log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, dest_path);
 			}
 		}
 
-		if (error == 0) {
-			struct dirent ** nl = NULL;
-			int nb_files = scandir(full_path, &nl, util_basic_filter, alphasort);
-			if (nb_files < 0) {
-				error = -1;
-				log_write(gettext("#%lu ! error, failed to list files from '%s' because %m"), i_job, output);
-			} else {
-				int length = strlen(full_path);
-				char * last = strrchr(full_path, '/');
-				if (last != NULL && last[1] == '\0') {
-					while (length > 0 && *last == '/') {
-						length--;
-						last--;
-					}
-				}
-
-				int i;
-				for (i = 0; i < nb_files; i++) {
-					if (error == 0) {
-						char * sub_file;
-						int size = asprintf(&sub_file, "%*s/%s", length, full_path, nl[i]->d_name);
-
-						if (size >= 0)
-							error = worker_process_do2(sub_file + (partial_path - full_path), sub_file, option);
-						else
-							error = 2;
-					}
-
-					free(nl[i]);
-				}
-				free(nl);
-			}
-		}
+		// content of directory will be listed by one of the walkers
+		if (error == 0)
+			error = worker_walk_push(walker, i_job, parent, src_path, dest_path);
 	} else if (S_ISFIFO(info.st_mode)) {
-		log_write(gettext("#%lu ~ create fifo '%s'"), i_job, output);
+		log_write(gettext("#%lu ~ create fifo '%s'"), i_job, dest_path);
 
-		error = mkfifo(output, info.st_mode);
+		error = mkfifoat(parent->fd_dest, dest_name, info.st_mode);
 		if (error != 0)
-			log_write(gettext("#%lu ! error, failed to create fifo '%s' because %m"), i_job, output);
+			log_write(gettext("#%lu ! error, failed to create fifo '%s' because %m"), i_job, dest_path);
 		else {
-			warning = chown(output, info.st_uid, info.st_gid);
+			warning = fchownat(parent->fd_dest, dest_name, info.st_uid, info.st_gid, 0);
 			if (warning != 0)
-				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, dest_path);
 		}
 	} else if (S_ISLNK(info.st_mode)) {
-		char link[256];
-		ssize_t nb_read = readlink(full_path, link, 256);
+		char link[PATH_MAX];
+		ssize_t nb_read = readlinkat(parent->fd_src, src_name, link, PATH_MAX - 1);
 		if (nb_read < 0) {
 			error = 1;
-			log_write(gettext("#%lu ! error, failed to reading symbolic link of '%s' because %m"), i_job, output);
+			log_write(gettext("#%lu ! error, failed to reading symbolic link of '%s' because %m"), i_job, dest_path);
 		} else
 			link[nb_read] = '\0';
 
@@ -521,76 +1526,548 @@ static int worker_process_do2(const char * partial_path, const char * full_path,
 		 */
 
 		if (error == 0) {
-			log_write(gettext("#%lu ~ create symbolic link '%s' => '%s'"), i_job, output, link);
-			error = symlink(link, output);
+			log_write(gettext("#%lu ~ create symbolic link '%s' => '%s'"), i_job, dest_path, link);
+			error = symlinkat(link, parent->fd_dest, dest_name);
 			if (error != 0)
-				log_write(gettext("#%lu ! error, failed to create symbolic link '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! error, failed to create symbolic link '%s' because %m"), i_job, dest_path);
 		}
 
 		if (error == 0) {
-			warning = chmod(output, info.st_mode);
+			warning = fchmodat(parent->fd_dest, dest_name, info.st_mode, 0);
 			if (warning != 0)
-				log_write(gettext("#%lu ! warning, failed to change permission of '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! warning, failed to change permission of '%s' because %m"), i_job, dest_path);
 
-			warning = chown(output, info.st_uid, info.st_gid);
+			warning = fchownat(parent->fd_dest, dest_name, info.st_uid, info.st_gid, 0);
 			if (warning != 0)
-				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, output);
+				log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, dest_path);
 		}
+	} else if (S_ISREG(info.st_mode) && option->split_size > 0 && info.st_size > option->split_size) {
+		struct worker_device * device = worker_device_get(info.st_dev, parent->dev_dest, option);
+		error = worker_process_split(i_job, parent, device, src_path, dest_path, &info, option);
 	} else if (S_ISREG(info.st_mode)) {
-		sem_wait(&worker_jobs);
-		pthread_mutex_lock(&worker_lock);
+		struct worker_lane * lane = worker_lanes + worker_lane_large;
+		if (worker_nb_lanes > 1 && info.st_size <= option->small_size)
+			lane = worker_lanes + worker_lane_small;
 
-		struct worker * worker = NULL;
-		unsigned int i;
-		for (i = 0; i < worker_nb_workers && worker == NULL; i++)
-			if (workers[i].status == worker_status_init)
-				worker = workers + i;
-
-		for (i = 0; i < worker_nb_workers && worker == NULL; i++)
-			if (workers[i].status == worker_status_finished) {
-				worker = workers + i;
-
-				free(worker->src_file);
-				free(worker->dest_file);
-				free(worker->description);
-				worker->src_file = worker->dest_file = NULL;
-				worker->description = NULL;
-			}
+		struct worker_device * device = worker_device_get(info.st_dev, parent->dev_dest, option);
+
+		if (lane == worker_lanes + worker_lane_small && option->group_files > 1)
+			return worker_batch_add(walker, parent, device, i_job, src_path, dest_path, option);
+
+		struct worker * worker = worker_acquire(lane);
+		worker->device = device;
 
 		worker->job = i_job;
-		worker->status = worker_status_running;
-		worker->src_file = strdup(full_path);
-		worker->dest_file = strdup(output);
-		worker->digest = NULL;
-		int size = asprintf(&worker->description, gettext("copy from '%s' to '%s'"), full_path, output);
+		worker->src_file = strdup(src_path);
+		worker->dest_file = strdup(dest_path);
+		worker->dir = worker_dir_ref(parent);
+		int size = asprintf(&worker->description, gettext("copy from '%s' to '%s'"), src_path, dest_path);
 		worker->pct = 0;
 		worker->option = option;
 
-		pthread_mutex_unlock(&worker_lock);
-
 		if (size < 0)
+			worker->description = NULL;
+
+		if (size < 0 || worker->src_file == NULL || worker->dest_file == NULL) {
+			worker_recycle(worker);
 			return -2;
+		}
 
-		char * name;
-		size = asprintf(&name, "worker #%lu", i_job);
+		worker->src_name = worker_dir_name(parent->src_length, worker->src_file);
+		worker->dest_name = worker_dir_name(parent->dest_length, worker->dest_file);
+
+		worker_submit(worker, worker_process_copy);
+	}
+
+	return error;
+}
+
+static bool worker_process_read_back(struct worker * worker, int fd, const char * filename, off_t size, bool direct, bool drop_cache, struct checksum * chck, float pct_base) {
+	char * buffer = buffer_get();
+	if (buffer == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), worker->job, filename);
+		return false;
+	}
+
+	/**
+	 * DONTNEED only evicts clean pages. They are already clean after fsync
+	 * but not when durability is deferred by --sync, so wait for writeback
+	 * first and the following reads have to reach the device.
+	 */
+	if (drop_cache) {
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	/**
+	 * With a bounded window, kernel read-ahead is disabled and we ask for
+	 * the next <window> bytes only, so verifying a big file neither floods
+	 * the page cache nor reads far beyond what has been hashed.
+	 */
+	off_t window = direct ? 0 : worker->option->verify_readahead;
+	if (window > 0)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+	off_t position = 0, readahead_end = 0;
+	ssize_t nb_read;
+	for (;;) {
+		if (window > 0 && readahead_end < size && position + window > readahead_end) {
+			posix_fadvise(fd, readahead_end, position + window - readahead_end, POSIX_FADV_WILLNEED);
+			readahead_end = position + window;
+		}
+
+		nb_read = pread(fd, buffer, BUFFER_SIZE, position);
+		if (nb_read <= 0)
+			break;
+
+		buffer = checksum_update_buffer(chck, buffer, nb_read);
+
+		if (drop_cache)
+			posix_fadvise(fd, position, nb_read, POSIX_FADV_DONTNEED);
+
+		position += nb_read;
+
+		float done = position;
+		done *= 1 - pct_base;
+		worker->pct = pct_base + done / size;
+
+		util_check_load_average(worker, worker->option->load_average);
+	}
+
+	buffer_release(buffer);
+
+	if (nb_read < 0) {
+		log_write(gettext("#%lu ! warning, error while reading from '%s' because %m"), worker->job, filename);
+		return false;
+	}
+
+	return true;
+}
+
+static int worker_process_split(unsigned long i_job, struct worker_dir * parent, struct worker_device * device, const char * src_path, const char * dest_path, const struct stat * info, const struct pcopy_option * option) {
+	int fd = openat(parent->fd_dest, worker_dir_name(parent->dest_length, dest_path), O_WRONLY | O_CREAT | O_TRUNC, info->st_mode);
+	if (fd < 0) {
+		log_write(gettext("#%lu ! error fatal, failed to open '%s' for writing because %m"), i_job, dest_path);
+		return 1;
+	}
+
+	if (fchown(fd, info->st_uid, info->st_gid) != 0)
+		log_write(gettext("#%lu ! warning, failed to change owner and group of '%s' because %m"), i_job, dest_path);
+
+	if (ftruncate(fd, info->st_size) != 0) {
+		log_write(gettext("#%lu ! error fatal, failed to set size of '%s' because %m"), i_job, dest_path);
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	struct worker_split * split = malloc(sizeof(struct worker_split));
+	if (split == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to split '%s'"), i_job, src_path);
+		return -2;
+	}
+
+	split->nb_chunks = (info->st_size + option->split_size - 1) / option->split_size;
+	split->copied = calloc(split->nb_chunks, sizeof(bool));
+	if (split->copied == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to split '%s'"), i_job, src_path);
+		free(split);
+		return -2;
+	}
+
+	split->checksum = worker_new_checksum(option, info->st_size);
+	if (split->checksum == NULL) {
+		log_write(gettext("#%lu ! error fatal, not enough memory to compute digest of '%s'"), i_job, src_path);
+		free(split->copied);
+		free(split);
+		return -2;
+	}
+
+	pthread_mutex_init(&split->lock, NULL);
+	split->size = info->st_size;
+	split->chunk_size = option->split_size;
+	split->nb_done = split->nb_hashed = 0;
+	split->hashing = split->failed = false;
+
+	log_write(gettext("#%lu @ split '%s' into %u chunks"), i_job, src_path, split->nb_chunks);
+
+	unsigned int i;
+	for (i = 0; i < split->nb_chunks; i++) {
+		struct worker * worker = worker_acquire(worker_lanes + worker_lane_large);
+
+		worker->job = i_job;
+		worker->src_file = strdup(src_path);
+		worker->dest_file = strdup(dest_path);
+		worker->dir = worker_dir_ref(parent);
+		worker->device = device;
+		worker->split = split;
+		worker->chunk = i;
+		int size = asprintf(&worker->description, gettext("copy chunk %u/%u from '%s' to '%s'"), i + 1, split->nb_chunks, src_path, dest_path);
+		worker->pct = 0;
+		worker->option = option;
 
 		if (size < 0)
+			worker->description = NULL;
+
+		if (size < 0 || worker->src_file == NULL || worker->dest_file == NULL) {
+			log_write(gettext("#%lu ! error fatal, not enough memory to copy chunk %u/%u of '%s'"), i_job, i + 1, split->nb_chunks, src_path);
+			worker->split = NULL;
+			worker_recycle(worker);
+
+			// chunks which will never run are accounted as failed
+			pthread_mutex_lock(&split->lock);
+			split->failed = true;
+			split->nb_done += split->nb_chunks - i;
+			bool release = !split->hashing && split->nb_done == split->nb_chunks;
+			pthread_mutex_unlock(&split->lock);
+
+			if (release)
+				worker_split_free(split);
+
 			return -2;
+		}
 
-		error = thread_pool_run(name, worker_process_copy, worker);
+		worker->src_name = worker_dir_name(parent->src_length, worker->src_file);
+		worker->dest_name = worker_dir_name(parent->dest_length, worker->dest_file);
 
-		if (error != 0)
-			log_write(gettext("#%lu ! error, failed to create new thread"), i_job);
+		worker_submit(worker, worker_process_copy);
+	}
+
+	return 0;
+}
+
+static void worker_recycle(struct worker * worker) {
+	worker_dir_unref(worker->dir);
+	worker->dir = NULL;
+
+	// the display may be reading these strings
+	pthread_mutex_lock(&worker->lock);
+
+	char * src_file = worker->src_file, * dest_file = worker->dest_file;
+	char * digest = worker->digest, * description = worker->description;
+	worker->src_file = worker->dest_file = worker->digest = worker->description = NULL;
+	worker->status = worker_status_finished;
+
+	pthread_mutex_unlock(&worker->lock);
+
+	free(src_file);
+	free(dest_file);
+	free(digest);
+	free(description);
+
+	queue_push(worker->lane->free_records, worker);
+
+	if (__atomic_sub_fetch(&worker_nb_active, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&worker_done_lock);
+		pthread_cond_broadcast(&worker_done_wait);
+		pthread_mutex_unlock(&worker_done_lock);
+	}
+}
+
+static void worker_walk(void * arg) {
+	struct worker_walker * walker = arg;
+
+	struct worker_walk_dir * dir;
+	while (dir = worker_walk_next(walker), dir != NULL) {
+		// after an error, remaining directories are dropped as a recursive walk would do
+		if (!worker_walk_failed && worker_walk_list(walker, dir) != 0)
+			worker_walk_failed = true;
+
+		worker_dir_unref(dir->parent);
+		free(dir->src_path);
+		free(dir->dest_path);
+		free(dir);
+
+		pthread_mutex_lock(&worker_walk_lock);
+		worker_walk_pending--;
+		if (worker_walk_pending == 0)
+			pthread_cond_broadcast(&worker_walk_wait);
+		pthread_mutex_unlock(&worker_walk_lock);
+	}
+
+	pthread_mutex_lock(&worker_walk_lock);
+	worker_nb_running_walkers--;
+	pthread_cond_broadcast(&worker_walk_wait);
+	pthread_mutex_unlock(&worker_walk_lock);
+}
+
+static int worker_walk_compare(const void * a, const void * b, void * arg) {
+	const struct worker_walk_entry * ea = a, * eb = b;
+
+	// same order as alphasort did with scandir
+	if (arg != NULL)
+		return strcoll((const char *) arg + ea->name, (const char *) arg + eb->name);
 
-		free(name);
+	if (ea->inode < eb->inode)
+		return -1;
+	return ea->inode > eb->inode;
+}
+
+static int worker_walk_entry(struct worker_walker * walker, struct worker_dir * dir, const char * name, unsigned char type) {
+	char * src_path = worker_dir_path(dir->src_path, name);
+	char * dest_path = worker_dir_path(dir->dest_path, name);
+	if (src_path == NULL || dest_path == NULL) {
+		free(src_path);
+		free(dest_path);
+		return 2;
+	}
+
+	/**
+	 * Thanks to d_type, statx is only asked for what will be used: sizes
+	 * are only needed by regular files. AT_STATX_DONT_SYNC avoids
+	 * revalidating attributes on network filesystems.
+	 */
+	unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID;
+	if (type == DT_REG || type == DT_UNKNOWN)
+		mask |= STATX_SIZE | STATX_BLOCKS;
+
+	struct statx stx;
+	if (statx(dir->fd_src, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx) != 0) {
+		unsigned long i_job = __atomic_add_fetch(&worker_n_jobs, 1, __ATOMIC_RELAXED);
+		log_write(gettext("#%lu ! error fatal, failed to get information of '%s' because %m"), i_job, src_path);
+		free(src_path);
+		free(dest_path);
+		return 1;
 	}
 
-	free(output);
+	struct stat info;
+	memset(&info, 0, sizeof(info));
+	info.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	info.st_ino = stx.stx_ino;
+	info.st_mode = stx.stx_mode;
+	info.st_uid = stx.stx_uid;
+	info.st_gid = stx.stx_gid;
+	info.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	info.st_size = stx.stx_size;
+	info.st_blocks = stx.stx_blocks;
+
+	int error = worker_process_do2(walker, dir, src_path, dest_path, &info, walker->option);
+
+	free(src_path);
+	free(dest_path);
 
 	return error;
 }
 
-void worker_release() {
-	pthread_mutex_unlock(&worker_lock);
+static int worker_walk_list(struct worker_walker * walker, struct worker_walk_dir * item) {
+	walker->nb_listed++;
+
+	struct worker_dir * parent = item->parent;
+
+	struct worker_dir * dir = malloc(sizeof(struct worker_dir));
+	if (dir == NULL) {
+		log_write(gettext("#%lu ! error, not enough memory to list files from '%s'"), item->job, item->src_path);
+		return 2;
+	}
+
+	dir->fd_src = openat(parent->fd_src, worker_dir_name(parent->src_length, item->src_path), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dir->fd_src < 0) {
+		log_write(gettext("#%lu ! error, failed to list files from '%s' because %m"), item->job, item->src_path);
+		free(dir);
+		return -1;
+	}
+
+	// destination is only used as base of *at() calls
+	dir->fd_dest = openat(parent->fd_dest, worker_dir_name(parent->dest_length, item->dest_path), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dir->fd_dest < 0) {
+		log_write(gettext("#%lu ! error, failed to open directory '%s' because %m"), item->job, item->dest_path);
+		close(dir->fd_src);
+		free(dir);
+		return -1;
+	}
+
+	dir->src_path = item->src_path;
+	dir->dest_path = item->dest_path;
+	item->src_path = item->dest_path = NULL;
+
+	// names of entries start after the separator
+	dir->src_length = strlen(dir->src_path);
+	while (dir->src_length > 1 && dir->src_path[dir->src_length - 1] == '/')
+		dir->src_path[--dir->src_length] = '\0';
+	dir->dest_length = strlen(dir->dest_path);
+	while (dir->dest_length > 1 && dir->dest_path[dir->dest_length - 1] == '/')
+		dir->dest_path[--dir->dest_length] = '\0';
+
+	dir->nb_refs = 1;
+
+	struct stat dest_info;
+	dir->dev_dest = fstat(dir->fd_dest, &dest_info) == 0 ? dest_info.st_dev : parent->dev_dest;
+
+	int fd = dir->fd_src;
+
+	char * buffer = buffer_get();
+	if (buffer == NULL) {
+		log_write(gettext("#%lu ! error, not enough memory to list files from '%s'"), item->job, dir->src_path);
+		worker_dir_unref(dir);
+		return 2;
+	}
+
+	enum pcopy_sort sort = walker->option->sort;
+
+	struct worker_walk_entry * entries = NULL;
+	unsigned int nb_entries = 0, nb_allocated = 0;
+	char * names = NULL;
+	size_t names_length = 0, names_allocated = 0;
+
+	/**
+	 * Entries are read by batches with getdents64. Without sorting, each
+	 * batch is processed at once so memory does not grow with the size of
+	 * the directory.
+	 */
+	int error = 0;
+	while (error == 0 && !worker_walk_failed) {
+		long nb_read = syscall(SYS_getdents64, fd, buffer, BUFFER_SIZE);
+		if (nb_read < 0) {
+			log_write(gettext("#%lu ! error, failed to list files from '%s' because %m"), item->job, dir->src_path);
+			error = -1;
+			break;
+		}
+
+		if (nb_read == 0)
+			break;
+
+		long offset;
+		for (offset = 0; offset < nb_read && error == 0 && !worker_walk_failed;) {
+			struct dirent64 * entry = (struct dirent64 *) (buffer + offset);
+			offset += entry->d_reclen;
+
+			if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+				continue;
+
+			if (sort == pcopy_sort_none) {
+				error = worker_walk_entry(walker, dir, entry->d_name, entry->d_type);
+				continue;
+			}
+
+			size_t name_length = strlen(entry->d_name) + 1;
+			if (nb_entries == nb_allocated) {
+				unsigned int new_allocated = nb_allocated > 0 ? 2 * nb_allocated : 256;
+				void * new_addr = realloc(entries, new_allocated * sizeof(struct worker_walk_entry));
+				if (new_addr == NULL) {
+					error = 2;
+					break;
+				}
+
+				entries = new_addr;
+				nb_allocated = new_allocated;
+			}
+
+			if (names_length + name_length > names_allocated) {
+				size_t new_allocated = names_allocated > 0 ? 2 * names_allocated : 16384;
+				while (new_allocated < names_length + name_length)
+					new_allocated *= 2;
+
+				void * new_addr = realloc(names, new_allocated);
+				if (new_addr == NULL) {
+					error = 2;
+					break;
+				}
+
+				names = new_addr;
+				names_allocated = new_allocated;
+			}
+
+			struct worker_walk_entry * ptr = entries + nb_entries++;
+			ptr->inode = entry->d_ino;
+			ptr->name = names_length;
+			ptr->type = entry->d_type;
+
+			memcpy(names + names_length, entry->d_name, name_length);
+			names_length += name_length;
+		}
+	}
+
+	buffer_release(buffer);
+
+	if (error == 2)
+		log_write(gettext("#%lu ! error, not enough memory to list files from '%s'"), item->job, dir->src_path);
+
+	if (nb_entries > 0 && error == 0) {
+		// inode order follows the layout of inode tables, which makes statx cheaper on big directories
+		qsort_r(entries, nb_entries, sizeof(struct worker_walk_entry), worker_walk_compare, sort == pcopy_sort_name ? names : NULL);
+
+		unsigned int i;
+		for (i = 0; i < nb_entries && error == 0 && !worker_walk_failed; i++)
+			error = worker_walk_entry(walker, dir, names + entries[i].name, entries[i].type);
+	}
+
+	free(entries);
+	free(names);
+
+	// the batch holds its own reference on the directory
+	worker_batch_submit(walker);
+
+	worker_dir_unref(dir);
+
+	return error;
+}
+
+static struct worker_walk_dir * worker_walk_next(struct worker_walker * walker) {
+	for (;;) {
+		pthread_mutex_lock(&worker_walk_lock);
+		unsigned long generation = worker_walk_generation;
+		bool done = worker_walk_closed && worker_walk_pending == 0;
+		pthread_mutex_unlock(&worker_walk_lock);
+
+		if (done)
+			return NULL;
+
+		struct worker_walk_dir * dir = deque_pop(walker->directories);
+		if (dir != NULL)
+			return dir;
+
+		unsigned int i;
+		for (i = 1; i < worker_nb_walkers; i++) {
+			struct worker_walker * victim = worker_walkers + (walker->index + i) % worker_nb_walkers;
+
+			dir = deque_steal(victim->directories);
+			if (dir != NULL) {
+				walker->nb_steals++;
+				return dir;
+			}
+		}
+
+		// sleep until a directory is pushed or the walk is over
+		pthread_mutex_lock(&worker_walk_lock);
+		while (generation == worker_walk_generation && !(worker_walk_closed && worker_walk_pending == 0))
+			pthread_cond_wait(&worker_walk_wait, &worker_walk_lock);
+		pthread_mutex_unlock(&worker_walk_lock);
+	}
+}
+
+static int worker_walk_push(struct worker_walker * walker, unsigned long i_job, struct worker_dir * parent, const char * src_path, const char * dest_path) {
+	struct worker_walk_dir * dir = malloc(sizeof(struct worker_walk_dir));
+	if (dir == NULL)
+		return 2;
+
+	/**
+	 * Only the parent stays open while the directory waits, so a directory
+	 * with many subdirectories does not hold a descriptor for each of them
+	 */
+	dir->job = i_job;
+	dir->parent = worker_dir_ref(parent);
+	dir->src_path = strdup(src_path);
+	dir->dest_path = strdup(dest_path);
+
+	pthread_mutex_lock(&worker_walk_lock);
+
+	if (dir->src_path == NULL || dir->dest_path == NULL || !deque_push(walker->directories, dir)) {
+		pthread_mutex_unlock(&worker_walk_lock);
+
+		worker_dir_unref(dir->parent);
+		free(dir->src_path);
+		free(dir->dest_path);
+		free(dir);
+		return 2;
+	}
+
+	worker_walk_pending++;
+	worker_walk_generation++;
+	pthread_cond_broadcast(&worker_walk_wait);
+
+	pthread_mutex_unlock(&worker_walk_lock);
+
+	return 0;
 }
 
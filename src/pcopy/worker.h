@@ -32,13 +32,30 @@
 #ifndef __PCOPY_WORKER_H__
 #define __PCOPY_WORKER_H__
 
+// pthread_mutex_t
+#include <pthread.h>
 // bool
 #include <stdbool.h>
 
 struct pcopy_option;
+struct worker_batch;
+struct worker_device;
+struct worker_dir;
+struct worker_lane;
+struct worker_split;
 
+/**
+ * Job record, all of them are allocated at startup and recycled through a
+ * queue of free records. The lock only protects strings read by the display
+ * against their replacement.
+ */
 struct worker {
+	pthread_mutex_t lock;
+
 	unsigned long job;
+	struct worker_lane * lane;
+	struct worker_device * device;
+	void (*process)(struct worker * worker);
 
 	char * src_file;
 	char * dest_file;
@@ -46,11 +63,27 @@ struct worker {
 
 	char * description;
 
+	// files are opened relative to their directories, names point into src_file and dest_file
+	struct worker_dir * dir;
+	const char * src_name;
+	const char * dest_name;
+
+	struct worker_split * split;
+	unsigned int chunk;
+
+	// small files of one directory copied one after another by this job
+	struct worker_batch * batch;
+
 	volatile float pct;
 	volatile bool paused;
 
+	// only written by the job running on this record, summed by --adaptive
+	volatile unsigned long nb_bytes;
+	volatile unsigned long nb_files;
+
 	volatile enum {
 		worker_status_init,
+		worker_status_queued,
 		worker_status_running,
 		worker_status_finished
 	} status;
@@ -61,7 +94,11 @@ struct worker {
 bool worker_finished(void);
 struct worker * worker_get(unsigned int * nb_working_workers, unsigned int * nb_total_workers);
 void worker_process(char * inputs[], unsigned int nb_inputs, const char * output, struct pcopy_option * option);
-void worker_release(void);
+/**
+ * Wait at most timeout milliseconds for the process to finish, returns
+ * as soon as it does
+ */
+bool worker_wait(unsigned int timeout);
 
 #endif
 